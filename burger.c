@@ -1,21 +1,143 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifndef BURGER_LIB
 #include <SDL2/SDL.h>
+#endif
+#include "burger.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 
 #define DISPLAY_WIDTH 320
 #define DISPLAY_HEIGHT 270
 #define HASH_PRIME 1009
 #define MAX_ENTITIES 256
+#define MAX_SCRIPT_EVENTS 4096
+#define MAX_GLYPH_ATLASES 4
+#define MAX_DRAW_COMMANDS 4096
+#define MAX_DIRTY_RECTS 64
+#define FIRST_GLYPH 33
+#define N_GLYPHS 94
+#define ENTITY_INDEX_BITS 10
+#define MAX_ENTITY_IDS (1 << ENTITY_INDEX_BITS)
+#define GRID_CELL_SIZE 16
+#define GRID_COLS ((DISPLAY_WIDTH + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+#define GRID_ROWS ((DISPLAY_HEIGHT + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+#define GRID_WORDS (MAX_ENTITIES / 64)
+#define PACK_FILE "burger.pak"
+#define PACK_MAGIC 0x4b504742 /* "BGPK" */
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define MAX_LEVELS 64
+#define LEVEL_VALUES 6 /* ints per entity in entities.dat */
+#define MAX_CATCH_UP_STEPS 5
+#define SPIN_NS 1000000
+#define HIDDEN_POLL_NS 100000000
+#define UNFOCUSED_RENDER_TICKS 6
+#define SNAPSHOT_FRESH 4
+#define MAX_RASTER_THREADS 16
+#define RASTER_MIN_PIXELS 16384
+#define MAX_SCALE 8
+#define PROFILE_EVENTS 16384 /* per thread, a power of two */
+#define REPLAY_MAGIC 0x50524742 /* "BGRP" */
+#define REPLAY_VERSION 1
+#define MAX_ENV_THREADS 64
+#define MAX_NAV_NODES 128
+#define AI_DECISION_BOOST 30 /* ticks of waiting */
+#define AI_NEAR_BOOST 15
+#define AI_NEAR_DISTANCE 48
 #define array_size(x) ((int)((sizeof(x)) / (sizeof(x[0]))))
 
+/* Every key in Input, in the bit order of recordings and of burger.h's
+ * actions. Expands into enum InputBit and input_names. */
+#define INPUT_LIST \
+	INPUT(up) \
+	INPUT(down) \
+	INPUT(left) \
+	INPUT(right) \
+	INPUT(a) \
+	INPUT(c) \
+	INPUT(d) \
+	INPUT(q) \
+	INPUT(f) \
+	INPUT(e) \
+	INPUT(g) \
+	INPUT(l) \
+	INPUT(m) \
+	INPUT(r) \
+	INPUT(s) \
+	INPUT(ctrl) \
+	INPUT(lshift) \
+	INPUT(space) \
+	INPUT(tab) \
+	INPUT(return)
+
+/* Every sprite the game loads, by asset name. Expands into enum SpriteId
+ * and sprite_names, so the hot path indexes sprites[] directly. */
+#define SPRITE_LIST \
+	SPRITE(girl_walk_frame1) \
+	SPRITE(girl_walk_frame2) \
+	SPRITE(girl_back_frame1) \
+	SPRITE(girl_back_frame2) \
+	SPRITE(girl_jump_frame1) \
+	SPRITE(girl_jump_frame2) \
+	SPRITE(girl_dead_frame1) \
+	SPRITE(girl_dead_frame2) \
+	SPRITE(girl_pepper_frame1) \
+	SPRITE(girl_pepper_frame2) \
+	SPRITE(girl_win_frame1) \
+	SPRITE(girl_win_frame2) \
+	SPRITE(hotdog_frame1) \
+	SPRITE(hotdog_frame2) \
+	SPRITE(egg_legs_frame1) \
+	SPRITE(egg_legs_frame2) \
+	SPRITE(platform_tile) \
+	SPRITE(ladder_tile) \
+	SPRITE(plate) \
+	SPRITE(tablecloth_tile) \
+	SPRITE(top_bun) \
+	SPRITE(tomato) \
+	SPRITE(meat) \
+	SPRITE(bottom_bun) \
+	SPRITE(door_frame1) \
+	SPRITE(door_frame2) \
+	SPRITE(background)
+
 
 /* ENUMS */
 
+/* What the profiler times. tick covers the others on the simulation
+ * thread; the rest of the list runs on the render thread. */
+enum Phase {
+	phase_tick,
+	phase_ai,
+	phase_move,
+	phase_detect,
+	phase_resolve,
+	phase_reap,
+	phase_input,
+	phase_draw,
+	phase_raster,
+	phase_blit,
+	n_phases
+};
+
 enum EntityType {
 	player,
 	hotdog,
@@ -33,6 +155,8 @@ enum EntityType {
 	all
 };
 
+_Static_assert(all == ENV_CHANNELS, "one observation plane per EntityType");
+
 typedef enum {
 	false, true
 } bool;
@@ -52,6 +176,36 @@ enum Direction {
 	right, left
 };
 
+/* A move along the nav graph. Opposite steps differ only in the low bit. */
+enum NavStep {
+	step_none = -1,
+	step_left,
+	step_right,
+	step_up,
+	step_down,
+	n_steps
+};
+
+enum InputBit {
+#define INPUT(name) input_##name,
+	INPUT_LIST
+#undef INPUT
+	n_input_bits
+};
+
+_Static_assert(ENV_UP == 1u << input_up && ENV_DOWN == 1u << input_down &&
+			   ENV_LEFT == 1u << input_left && ENV_RIGHT == 1u << input_right &&
+			   ENV_JUMP == 1u << input_ctrl,
+			   "burger.h's action bits must follow INPUT_LIST");
+
+enum SpriteId {
+	no_sprite = -1,
+#define SPRITE(name) sprite_##name,
+	SPRITE_LIST
+#undef SPRITE
+	n_sprites
+};
+
 
 /* STRUCTS */
 
@@ -82,9 +236,11 @@ typedef struct {
 	enum EntityType type;
 	enum AnimationState anim_state;
 	V2 a, v, p;
+	V2 prev_p;
 	V2 hitbox;
 	V2 speed;
 	V2 damp;
+	double damp_factor_x, damp_factor_y;
 	V2 dest;
 	int w, h;
 	bool on_ground;
@@ -134,12 +290,34 @@ typedef struct {
 	Win_BMP_Header header;
 } Win_BMP;
 
+/* burger.pak: this header, one Pack_Entry per bitmap, then the pixels
+ * already in the runtime ABGR layout (offset[left] holds the mirrored
+ * copy, or 0 if there is none), then entities.dat verbatim. */
+typedef struct {
+	int magic;
+	int version;
+	int n_entries;
+	int level_offset;
+	int level_size;
+} Pack_Header;
+
+typedef struct {
+	char name[30];
+	int w, h;
+	int offset[2];
+} Pack_Entry;
+
 typedef struct {
+#ifndef BURGER_LIB
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_Texture *texture;
+#endif
 	int w, h;
-	unsigned char *data;
+	/* Output size over the game's; above 1, or with epx, blit_display
+	 * scales display_bitmap into the texture instead of copying it. */
+	int scale;
+	bool epx;
 } Display;
 
 typedef struct {
@@ -165,47 +343,357 @@ typedef struct {
 	int key_return;
 } Input;
 
+typedef struct {
+	int frame;
+	Input input;
+} Input_Event;
+
 typedef struct {
 	int w, h;
+	int pitch; /* bytes per row */
 	int nbytes;
 	unsigned char *data;
 } Bitmap;
 
+/* Pre-baked variants of one asset, indexed by Direction. */
+typedef struct {
+	Bitmap bitmap[2];
+} Sprite;
+
+/* The font sheet resampled to one scale, with each glyph's source rect
+ * already in draw_bitmap's offset terms. */
+typedef struct {
+	int sx_off, sw_off;
+} Glyph;
+
+typedef struct {
+	float scale;
+	Bitmap bitmap;
+	int sh_off;
+	Glyph glyph[N_GLYPHS];
+} Glyph_Atlas;
+
+typedef struct {
+	int x, y, w, h;
+} Rect;
+
+/* One draw_bitmap call, recorded so frames can be compared and only
+ * the parts that changed redrawn. rect is the area it covers on the
+ * display. */
+typedef struct {
+	Bitmap bitmap;
+	int x, y;
+	int sx_off, sy_off, sw_off, sh_off;
+	int color;
+	Rect rect;
+} Draw_Command;
+
 typedef struct {
 	void *buffer, *p;
 	int n_elems, max_elems, elem_size;
 } Memory;
 
+/* Entity ids are handles: the low ENTITY_INDEX_BITS pick an entry here,
+ * the rest must match its generation or the handle is stale. Ids read
+ * from entities.dat are generation 0, so they keep their values. */
+typedef struct {
+	int slot[MAX_ENTITY_IDS];
+	int generation[MAX_ENTITY_IDS];
+	int free_indices[MAX_ENTITY_IDS];
+	int n_free;
+	int next_index;
+} Handle_Table;
+
+typedef struct {
+	int x1, y1, x2, y2;
+} Grid_Span;
+
+/* Broadphase: one bit per entity slot in every cell its box touches,
+ * so a query ORs a few cells together and walks the bits in slot order. */
+typedef struct {
+	uint64_t cells[GRID_ROWS][GRID_COLS][GRID_WORDS];
+	Grid_Span span[MAX_ENTITIES];
+} Grid;
+
+/* An NPC waiting for schedule_ai, by slot. */
+typedef struct {
+	int slot;
+	int priority;
+} Ai_Request;
+
+/* Where ladders meet a platform: the one going up from it and the one
+ * going down, either of which may be the same ladder or -1. link[] is the
+ * next node along the platform or the ladders for each NavStep, or -1. */
+typedef struct {
+	V2 p;
+	int platform;
+	int ladders[2];
+	int link[n_steps];
+} Nav_Node;
+
+/* Where an entity is in the nav graph: at a node, or on the platform or
+ * ladder between nodes a (left or above) and b, da and db away. */
+typedef struct {
+	int node;
+	int platform;
+	int ladder;
+	int a, b;
+	float da, db;
+	bool vertical;
+} Nav_Place;
+
+/* A decoded level: its entities with the handle table, grid and nav
+ * graph built for them, and the static layer baked from them. Starting
+ * the level is a few bulk copies out of here. */
+typedef struct {
+	Entity entities[MAX_ENTITIES];
+	int n_entities;
+	Handle_Table handles;
+	Grid grid;
+	Nav_Node nav[MAX_NAV_NODES];
+	int n_nav;
+	Bitmap static_layer;
+} Level_Template;
+
+/* What the render thread needs to draw one entity. */
+typedef struct {
+	enum SpriteId sprite;
+	V2 p, prev_p;
+	int w, h;
+	enum Direction direction;
+} Sprite_Instance;
+
+/* Everything a frame is drawn from, published by the simulation thread
+ * once per tick and never written again until it has been handed back. */
+typedef struct {
+	Sprite_Instance instances[MAX_ENTITIES];
+	int n_instances;
+	int level_slot;
+	int level_serial;
+	long long tick_time;
+	bool start_screen_state;
+	bool reset_npcs_state;
+	bool playing;
+	bool win;
+} Render_Snapshot;
+
+/* One run of the game: everything the simulation reads and writes, so
+ * that any number of them can be stepped side by side. rng_state is the
+ * run's own generator, so a run is reproduced from its seed alone. */
+typedef struct {
+	Memory entities;
+	Grid grid;
+	Handle_Table handles;
+	Input input, last_input;
+	int level;
+	bool reset_npcs_state;
+	bool start_screen_state;
+	bool playing;
+	bool win;
+	float spawn_timer;
+	float reset_timer;
+	float win_timer;
+	unsigned int rng_state;
+	int tick_count;
+	/* The flow field: every nav node's path length to the player and
+	 * its first step along that path, shared by all NPCs. */
+	float nav_dist[MAX_NAV_NODES];
+	enum NavStep nav_step[MAX_NAV_NODES];
+	Nav_Place player_place;
+	/* NPC decisions per tick, 0 for no limit; over it, only NPCs with
+	 * ai_due set decide and the rest keep their last intent. ai_age and
+	 * ai_due are by handle index, which stays put when slots move. */
+	int ai_budget;
+	bool ai_throttled;
+	int ai_age[MAX_ENTITY_IDS];
+	bool ai_due[MAX_ENTITY_IDS];
+} Game;
+
+typedef struct {
+	Env *env;
+	int part;
+} Env_Worker;
+
+/* Instances are split into n_parts contiguous runs, one per worker and
+ * part 0 for the caller, and work is run on each part the way
+ * Raster_Pool rasterizes bands. */
+struct Env {
+	Game *games;
+	int n_games;
+	Env_Worker workers[MAX_ENV_THREADS];
+	pthread_t threads[MAX_ENV_THREADS];
+	int n_threads;
+	int n_parts;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	int generation;
+	int n_pending;
+	bool quit;
+	void (*work)(Env *, int);
+	const unsigned int *actions;
+	unsigned char *pixels;
+	int obs_w, obs_h;
+	int obs_layout;
+	int ai_budget;
+};
+
+/* A recording: this header, then one Replay_Frame per tick. */
+typedef struct {
+	int magic;
+	int version;
+	unsigned int seed;
+	int n_frames;
+} Replay_Header;
+
+/* The tick's Input as one bit per input_names entry, and state_hash
+ * after the tick. */
+typedef struct {
+	unsigned int input;
+	unsigned int hash;
+} Replay_Frame;
+
+typedef struct {
+	long long start, end;
+	enum Phase phase;
+} Profile_Event;
+
+/* Written only by its own thread; n counts every event ever recorded, so
+ * the oldest kept is at n - PROFILE_EVENTS once it has wrapped. */
+typedef struct {
+	const char *name;
+	Profile_Event events[PROFILE_EVENTS];
+	unsigned int n;
+} Profile_Ring;
+
+/* Threads that rasterize compose_frame's dirty rects, one horizontal band
+ * of the display each; band 0 is done by the caller. */
+typedef struct {
+	pthread_t threads[MAX_RASTER_THREADS];
+	int n_threads;
+	int n_bands;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	int generation;
+	int n_pending;
+	Memory list;
+	Rect rect;
+} Raster_Pool;
+
 
 /* GLOBALS */
 
 const float frame_dt = 1.0f / 60.0f;
 
-struct timespec start_time, end_time;
 const float ns_per_s = 1000000000;
-long long int target_time = (long long int)(frame_dt * ns_per_s);
+const long long tick_ns = (long long)(frame_dt * 1000000000);
+bool vsync = false;
 
 Display display;
 
 Bitmap display_bitmap;
-Bitmap background_bitmap;
 Bitmap chars_bitmap;
 
-Input old_input, new_input;
-
 Memory memory;
 
-Memory asset_bitmaps;
+unsigned char *level_data;
+int level_size;
+int n_levels;
+int level_offsets[MAX_LEVELS];
+
+Glyph_Atlas glyph_atlases[MAX_GLYPH_ATLASES];
+int n_glyph_atlases;
+
+/* Command lists for this frame and the last one, and what each was
+ * drawn over: a level's static layer, or NULL for a black screen. */
+Memory draw_lists[2];
+int current_draw_list;
+/* Where push_draw_command goes on this thread: the current draw list on
+ * the main thread, bake_list on the preload thread. */
+_Thread_local Memory *draw_target;
+Memory bake_list;
+/* Off when nothing will draw the levels: headless runs other than
+ * --bench-raster, and batched environments. */
+bool bake_static_layers = true;
+Bitmap *frame_base;
+Bitmap *last_frame_base;
+
+Rect dirty_rects[MAX_DIRTY_RECTS];
+int n_dirty_rects;
+bool full_redraw = true;
+
+Memory input_script;
+
+/* The level being played and the next one, which preload_thread decodes
+ * into the other slot while this one is played. */
+Level_Template levels[2];
+int current_slot;
+/* Every level, decoded once for batched environments, which share them
+ * and have no preload. NULL otherwise. */
+Level_Template *env_levels;
+pthread_once_t env_levels_once = PTHREAD_ONCE_INIT;
+int preload_level;
+pthread_t preload_thread;
+bool preloading = false;
+/* A slot is only preloaded into once the render thread has drawn a
+ * snapshot of the level that replaced it, so its static layer is free. */
+bool preload_wanted = false;
+int level_serial = 0;
+_Atomic int drawn_level_serial = 0;
+
+/* Triple buffer from the simulation thread to the render thread. The
+ * simulation fills snapshots[snapshot_back] and swaps it into
+ * snapshot_shared, marked SNAPSHOT_FRESH; the render thread swaps
+ * snapshot_front for it when the mark is there. Neither side waits. */
+Render_Snapshot snapshots[3];
+int snapshot_back = 0;
+int snapshot_front = 1;
+_Atomic int snapshot_shared = 2;
+
+pthread_t sim_thread;
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+Input shared_input;
+_Atomic bool sim_paused = false;
+
+const char *phase_names[n_phases] = {
+	"tick", "ai", "move", "detect", "resolve", "reap",
+	"input", "draw", "raster", "blit"
+};
 
-Memory bitmap_buffer;
+/* Profiling is on for a thread once it points profile_ring at its ring.
+ * phase_avg holds a running average per phase for the HUD. */
+Profile_Ring profile_rings[2] = {{.name = "simulation"}, {.name = "render"}};
+_Thread_local Profile_Ring *profile_ring;
+_Atomic long long phase_avg[n_phases];
+_Thread_local long long phase_sum[n_phases];
+_Thread_local enum Phase current_phase;
+_Thread_local long long phase_mark;
+long long profile_epoch;
+bool show_profile = false;
+
+unsigned int seed;
+
+FILE *record_file;
+int n_recorded_frames;
+Replay_Frame *replay_frames;
+int n_replay_frames;
+int replay_mismatch = -1;
+
+Raster_Pool raster = {
+	.n_bands = 1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
 
-Memory entities;
+_Atomic int running = 1;
 
-int running = 1;
-bool reset_npcs_state = false;
-bool start_screen_state = true;
-bool playing = false;
-bool win = false;
+/* The run the window or --headless plays, and the one this thread is
+ * simulating: main_game everywhere except on batched-environment
+ * workers, which point it at each of their instances in turn. */
+Game main_game = {.start_screen_state = true, .rng_state = 1};
+_Thread_local Game *game = &main_game;
 
 Hash_Entry bitmap_table[HASH_PRIME];
 
@@ -236,104 +724,121 @@ Entity plate_defaults = {
 	.hitbox.y = 2
 };
 
-char *player_bitmap_list[] = {
-	"girl_walk_frame1",
-	"girl_walk_frame2",
-	"girl_back_frame1",
-	"girl_back_frame2",
-	"girl_jump_frame1",
-	"girl_jump_frame2",
-	"girl_dead_frame1",
-	"girl_dead_frame2",
-	"girl_pepper_frame1",
-	"girl_pepper_frame2",
-	"girl_win_frame1",
-	"girl_win_frame2",
-	NULL
+struct {
+	char *name;
+	int offset;
+} input_names[] = {
+#define INPUT(name) {#name, offsetof(Input, key_##name)},
+	INPUT_LIST
+#undef INPUT
 };
 
-char *hotdog_bitmap_list[] = {
-	"hotdog_frame1",
-	"hotdog_frame2",
-	NULL
+char *sprite_names[] = {
+#define SPRITE(name) #name,
+	SPRITE_LIST
+#undef SPRITE
 };
 
-char *egg_bitmap_list[] = {
-	"egg_legs_frame1",
-	"egg_legs_frame2",
-	NULL
+Sprite sprites[n_sprites];
+
+enum SpriteId player_sprite_list[] = {
+	sprite_girl_walk_frame1,
+	sprite_girl_walk_frame2,
+	sprite_girl_back_frame1,
+	sprite_girl_back_frame2,
+	sprite_girl_jump_frame1,
+	sprite_girl_jump_frame2,
+	sprite_girl_dead_frame1,
+	sprite_girl_dead_frame2,
+	sprite_girl_pepper_frame1,
+	sprite_girl_pepper_frame2,
+	sprite_girl_win_frame1,
+	sprite_girl_win_frame2,
+	no_sprite
 };
 
-char *platform_bitmap_list[] = {
-	"platform_tile",
-	NULL
+enum SpriteId hotdog_sprite_list[] = {
+	sprite_hotdog_frame1,
+	sprite_hotdog_frame2,
+	no_sprite
 };
 
-char *ladder_bitmap_list[] = {
-	"ladder_tile",
-	NULL
+enum SpriteId egg_sprite_list[] = {
+	sprite_egg_legs_frame1,
+	sprite_egg_legs_frame2,
+	no_sprite
 };
 
-char *plate_bitmap_list[] = {
-	"plate",
-	NULL
+enum SpriteId platform_sprite_list[] = {
+	sprite_platform_tile,
+	no_sprite
 };
 
-char *tablecloth_bitmap_list[] = {
-	"tablecloth_tile",
-	NULL
+enum SpriteId ladder_sprite_list[] = {
+	sprite_ladder_tile,
+	no_sprite
 };
 
-char *top_bun_bitmap_list[] = {
-	"top_bun",
-	NULL
+enum SpriteId plate_sprite_list[] = {
+	sprite_plate,
+	no_sprite
 };
 
-char *tomato_bitmap_list[] = {
-	"tomato",
-	NULL
+enum SpriteId tablecloth_sprite_list[] = {
+	sprite_tablecloth_tile,
+	no_sprite
 };
 
-char *meat_bitmap_list[] = {
-	"meat",
-	NULL
+enum SpriteId top_bun_sprite_list[] = {
+	sprite_top_bun,
+	no_sprite
 };
 
-char *bottom_bun_bitmap_list[] = {
-	"bottom_bun",
-	NULL
+enum SpriteId tomato_sprite_list[] = {
+	sprite_tomato,
+	no_sprite
 };
 
-char *door_bitmap_list[] = {
-	"door_frame1",
-	"door_frame2",
-	NULL
+enum SpriteId meat_sprite_list[] = {
+	sprite_meat,
+	no_sprite
 };
 
-char *wall_bitmap_list[] = {
-	NULL
+enum SpriteId bottom_bun_sprite_list[] = {
+	sprite_bottom_bun,
+	no_sprite
 };
 
-char *background_bitmap_list[] = {
-	"background",
-	NULL
+enum SpriteId door_sprite_list[] = {
+	sprite_door_frame1,
+	sprite_door_frame2,
+	no_sprite
+};
+
+enum SpriteId wall_sprite_list[] = {
+	no_sprite
+};
+
+enum SpriteId background_sprite_list[] = {
+	sprite_background,
+	no_sprite
 };
 
-char **entity_bitmap_list[] = {
-	player_bitmap_list,
-	hotdog_bitmap_list,
-	egg_bitmap_list,
-	platform_bitmap_list,
-	ladder_bitmap_list,
-	plate_bitmap_list,
-	tablecloth_bitmap_list,
-	top_bun_bitmap_list,
-	tomato_bitmap_list,
-	meat_bitmap_list,
-	bottom_bun_bitmap_list,
-	door_bitmap_list,
-	wall_bitmap_list,
-	background_bitmap_list,
+enum SpriteId *entity_sprite_list[] = {
+	player_sprite_list,
+	hotdog_sprite_list,
+	egg_sprite_list,
+	platform_sprite_list,
+	ladder_sprite_list,
+	plate_sprite_list,
+	tablecloth_sprite_list,
+	top_bun_sprite_list,
+	tomato_sprite_list,
+	meat_sprite_list,
+	bottom_bun_sprite_list,
+	door_sprite_list,
+	wall_sprite_list,
+	background_sprite_list,
 	NULL
 };
 
@@ -349,10 +854,40 @@ Collision *search_collisions(Entity *, enum EntityType);
 void off_ladder(Entity *);
 void move_entity(Entity *);
 Entity *add_entity(enum EntityType, float, float);
+void reset_handles(Handle_Table *);
+int entity_index(int);
+int entity_generation(int);
+bool is_static(Entity *);
+void bake_static_layer(Level_Template *);
+void build_nav(Level_Template *);
+bool index_levels();
+Level_Template *current_template();
+enum NavStep npc_nav_step(Entity *);
+bool at_decision_point(Entity *);
+long long now_ns();
+void simulate_tick();
+Bitmap flip_bitmap(Bitmap);
+int new_entity_id();
+Entity *push_entity(Entity *);
+void delete_entity(Entity *);
 
 
 /* FUNCTION DEFINITIONS */
 
+void seed_rng(unsigned int s)
+{
+	game->rng_state = s ? s : 1;
+}
+
+/* xorshift32, 0 to 2^31 - 1 like rand(). */
+int game_rand()
+{
+	game->rng_state ^= game->rng_state << 13;
+	game->rng_state ^= game->rng_state >> 17;
+	game->rng_state ^= game->rng_state << 5;
+	return (int)(game->rng_state >> 1);
+}
+
 void hash_insert(Hash_Entry *hash_table, char *key, void *value)
 {
 	int h;
@@ -415,6 +950,19 @@ void init_memory(int max_elems)
 	memory.elem_size = 1;
 }
 
+/* Like reserve_memory, for blocks there can be too many of to fit the
+ * arena. */
+Memory heap_memory(int max_elems, int elem_size)
+{
+	Memory res;
+	res.buffer = calloc(max_elems, elem_size);
+	res.p = res.buffer;
+	res.max_elems = max_elems;
+	res.n_elems = 0;
+	res.elem_size = elem_size;
+	return res;
+}
+
 Memory reserve_memory(int max_elems, int elem_size)
 {
 	Memory res;
@@ -449,24 +997,53 @@ void *get_memory_block(Memory block)
 	return block.buffer;
 }
 
-Bitmap read_win_bmp(char *filename)
+void clear_memory(Memory *block)
 {
-	FILE *fp;
-	Win_BMP bmp;
-	Bitmap bitmap;
-	fp = fopen(filename, "r");
+	block->p = block->buffer;
+	block->n_elems = 0;
+}
+
+/* Returns NULL, having said so, if the file can't be opened. */
+unsigned char *read_file(char *filename, int *size)
+{
+	FILE *fp = fopen(filename, "r");
+
+	if (!fp) {
+		fprintf(stderr, "can't open %s\n", filename);
+		return NULL;
+	}
+
 	fseek(fp, 0, SEEK_END);
 	int n = ftell(fp);
 	rewind(fp);
-	bmp.data = (unsigned char *)malloc(n);
-	fread(bmp.data, 1, n, fp);
-	bmp.header = *(Win_BMP_Header *)bmp.data;
-	bmp.data += bmp.header.dataoffset;
+	unsigned char *data = (unsigned char *)malloc(n);
+	fread(data, 1, n, fp);
+	fclose(fp);
+
+	if (size)
+		*size = n;
+
+	return data;
+}
+
+/* The bitmap's data is NULL if the file can't be read. */
+Bitmap read_win_bmp(char *filename)
+{
+	Win_BMP bmp;
+	Bitmap bitmap = {0};
+	unsigned char *file = read_file(filename, NULL);
+
+	if (!file)
+		return bitmap;
+
+	bmp.header = *(Win_BMP_Header *)file;
+	bmp.data = file + bmp.header.dataoffset;
 	bitmap.nbytes = bmp.header.width * bmp.header.height * 4;
 	bitmap.data = (unsigned char *)malloc(bitmap.nbytes);
 	unsigned char *p = bmp.data + (bmp.header.width * 4 * (bmp.header.height - 1));
 	bitmap.w = bmp.header.width;
 	bitmap.h = bmp.header.height;
+	bitmap.pitch = bitmap.w * 4;
 
 	for (int y = 0; y < bitmap.h; ++y) {
 		for (int x = 0; x < bitmap.w * 4; x += 4) {
@@ -481,214 +1058,778 @@ Bitmap read_win_bmp(char *filename)
 		}
 	}
 
+	free(file);
+
 	return bitmap;
 }
 
-void load_win_bmps()
+/* Names only matter while loading and for debugging; the game itself
+ * goes through sprites[] by SpriteId. */
+void init_sprite_table()
 {
-	asset_bitmaps = reserve_memory(50, sizeof(Bitmap));
-
-	for (int i = 0; entity_bitmap_list[i]; ++i) {
-		for (int j = 0; entity_bitmap_list[i][j]; ++j) {
-			char filepath[100] = "";
-			strcat(filepath, "assets/");
-			strcat(filepath, entity_bitmap_list[i][j]);
-			strcat(filepath, ".bmp");
-			Bitmap bitmap = read_win_bmp(filepath);
-			void *p = push_memory(&asset_bitmaps, &bitmap);
-			hash_insert(bitmap_table, entity_bitmap_list[i][j], p);
-		}
+	for (int id = 0; id < n_sprites; ++id) {
+		hash_insert(bitmap_table, sprite_names[id], &sprites[id]);
 	}
 }
 
-void clear_bitmap(Bitmap bitmap, unsigned int color)
+Sprite *get_sprite(enum SpriteId id)
 {
-	unsigned int *bitmap_p = (unsigned int *)bitmap.data;
+	return id == no_sprite ? NULL : &sprites[id];
+}
 
-	for (int y = 0; y < bitmap.h; ++y) {
-		for (int x = 0; x < bitmap.w; ++x) {
-			*bitmap_p++ = color;
-		}
-	}
+Sprite *find_sprite(const char *name)
+{
+	return (Sprite *)hash_lookup(bitmap_table, name);
 }
 
-void lerp_color(unsigned int src, unsigned int *dest)
+bool load_win_bmps()
 {
-	float a = (src & 0xff) / 255.0f;
+	for (int id = 0; id < n_sprites; ++id) {
+		char filepath[100] = "";
+		strcat(filepath, "assets/");
+		strcat(filepath, sprite_names[id]);
+		strcat(filepath, ".bmp");
+		sprites[id].bitmap[right] = read_win_bmp(filepath);
 
-	if (a == 0.0f) return;
+		if (!sprites[id].bitmap[right].data)
+			return false;
 
-	if (a < 1.0f) {
-		int dest_color = *dest;
-		int b = (int)((1 - a) * (dest_color >> 24 & 0xff)) + (int)(a * (src >> 24 & 0xff));
-		int g = (int)((1 - a) * (dest_color >> 16 & 0xff)) + (int)(a * (src >> 16 & 0xff));
-		int r = (int)((1 - a) * (dest_color >> 8 & 0xff)) + (int)(a * (src >> 8 & 0xff));
-		*dest = b << 24 | g << 16 | r << 8 | (src & 0xff);
-	} else {
-		*dest = src;
+		sprites[id].bitmap[left] = flip_bitmap(sprites[id].bitmap[right]);
 	}
+
+	chars_bitmap = read_win_bmp("assets/chars/chars.bmp");
+	return chars_bitmap.data != NULL;
 }
 
-Bitmap flip_bitmap(Bitmap bitmap)
+int pack_align(int offset)
 {
-	Bitmap flipped_bitmap;
-	flipped_bitmap.w = bitmap.w;
-	flipped_bitmap.h = bitmap.h;
-	flipped_bitmap.data = (unsigned char *)get_memory_block(bitmap_buffer);
-
-	for (int y = 0; y < bitmap.h; ++y) {
-		unsigned int *src = (unsigned int *)bitmap.data + (y * bitmap.w);
-		unsigned int *dest = (unsigned int *)flipped_bitmap.data + (y * bitmap.w);
+	return (offset + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+}
 
-		for (int x = 0; x < bitmap.w; ++x) {
-			*(dest + x) = *(src + ((bitmap.w - 1) - x));
-		}
+/* Offline: bake the loaded bitmaps, their flipped copies, the font and
+ * entities.dat into one file the game can map at startup. */
+void write_pack(char *filename)
+{
+	int n_entries = n_sprites + 1;
+	Pack_Entry *entries = (Pack_Entry *)calloc(n_entries, sizeof(Pack_Entry));
+	Bitmap *bitmaps[n_entries][2];
+	int level_bytes;
+	unsigned char *level = read_file("entities.dat", &level_bytes);
+
+	if (!level)
+		exit(1);
+
+	int offset = pack_align(sizeof(Pack_Header) + (n_entries * sizeof(Pack_Entry)));
+	int n = 0;
+
+	for (; n < n_sprites; ++n) {
+		strcpy(entries[n].name, sprite_names[n]);
+		bitmaps[n][right] = &sprites[n].bitmap[right];
+		bitmaps[n][left] = &sprites[n].bitmap[left];
 	}
 
-	return flipped_bitmap;
-}
+	strcpy(entries[n].name, "chars");
+	bitmaps[n][right] = &chars_bitmap;
+	bitmaps[n][left] = NULL;
 
-Bitmap color_fill_bitmap(Bitmap bitmap, int color)
-{
-	Bitmap color_filled_bitmap;
-	color_filled_bitmap.w = bitmap.w;
-	color_filled_bitmap.h = bitmap.h;
-	color_filled_bitmap.data = (unsigned char *)get_memory_block(bitmap_buffer);
+	for (int i = 0; i < n_entries; ++i) {
+		entries[i].w = bitmaps[i][right]->w;
+		entries[i].h = bitmaps[i][right]->h;
 
-	for (int y = 0; y < bitmap.h; ++y) {
-		unsigned int *src = (unsigned int *)bitmap.data + (y * bitmap.w);
-		unsigned int *dest = (unsigned int *)color_filled_bitmap.data + (y * bitmap.w);
+		for (int d = right; d <= left; ++d) {
+			if (bitmaps[i][d]) {
+				entries[i].offset[d] = offset;
+				offset = pack_align(offset + bitmaps[i][d]->nbytes);
+			}
+		}
+	}
 
-		for (int x = 0; x < bitmap.w; ++x) {
-			if (*(src + x) & 0xff) {
-				*(dest + x) = color;
+	Pack_Header header = {PACK_MAGIC, PACK_VERSION, n_entries, offset, level_bytes};
+	unsigned char *pack = (unsigned char *)calloc(offset + level_bytes, 1);
+	memcpy(pack, &header, sizeof(header));
+	memcpy(pack + sizeof(header), entries, n_entries * sizeof(Pack_Entry));
+
+	for (int i = 0; i < n_entries; ++i) {
+		for (int d = right; d <= left; ++d) {
+			if (bitmaps[i][d]) {
+				memcpy(pack + entries[i].offset[d], bitmaps[i][d]->data, bitmaps[i][d]->nbytes);
 			}
 		}
 	}
 
-	return color_filled_bitmap;
+	memcpy(pack + offset, level, level_bytes);
+
+	FILE *fp = fopen(filename, "w");
+
+	if (!fp || fwrite(pack, 1, offset + level_bytes, fp) != (size_t)(offset + level_bytes)) {
+		fprintf(stderr, "can't write %s\n", filename);
+		exit(1);
+	}
+
+	fclose(fp);
+	free(pack);
+	free(entries);
+	free(level);
 }
 
-void draw_bitmap(
-	Bitmap src_bitmap,
-	Bitmap dest_bitmap,
-	int dx, int dy,
-	int32_t sx_off, int32_t sy_off,
-	int32_t sw_off, int32_t sh_off,
-	int override_color)
+Bitmap pack_bitmap(unsigned char *pack, Pack_Entry *entry, enum Direction direction)
 {
-	int x1 = dx;
-	int y1 = dy;
-	int x2 = dx + src_bitmap.w - sx_off + sw_off;
-	int y2 = dy + src_bitmap.h - sy_off + sh_off;
-	int x_off = sx_off;
-	int y_off = sy_off;
+	Bitmap bitmap;
+	bitmap.w = entry->w;
+	bitmap.h = entry->h;
+	bitmap.pitch = entry->w * 4;
+	bitmap.nbytes = entry->w * entry->h * 4;
+	bitmap.data = pack + entry->offset[direction];
+	return bitmap;
+}
+
+/* Whether n bytes at offset lie inside a file of size bytes. */
+bool pack_range(off_t size, long long offset, long long n)
+{
+	return offset >= 0 && n >= 0 && offset + n <= (long long)size;
+}
 
-	if (x1 < 0) {
-		x_off -= x1;
-		x1 = 0;
+/* Maps the pack read-only and points every Bitmap straight into it.
+ * Returns false if there is no usable pack, so the caller can fall back
+ * to the loose .bmp files. Nothing is pointed into the pack until every
+ * entry has been checked against the file's size and every sprite has
+ * been found, so a truncated or stale pack is never half used. */
+bool load_pack(char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Pack_Header)) {
+		close(fd);
+		return false;
 	}
 
-	if (y1 < 0) {
-		y_off -= y1;
-		y1 = 0;
+	unsigned char *pack = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (pack == MAP_FAILED)
+		return false;
+
+	Pack_Header *header = (Pack_Header *)pack;
+	Pack_Entry *entries = (Pack_Entry *)(pack + sizeof(Pack_Header));
+	/* By SpriteId, with the font last. */
+	Pack_Entry *found[n_sprites + 1] = {};
+	char problem[64] = "";
+
+	if (header->magic != PACK_MAGIC || header->version != PACK_VERSION) {
+		snprintf(problem, sizeof(problem), "not a version %d pack", PACK_VERSION);
+	} else if (!pack_range(st.st_size, sizeof(Pack_Header), (long long)header->n_entries * (long long)sizeof(Pack_Entry)) ||
+			   !pack_range(st.st_size, header->level_offset, header->level_size)) {
+		snprintf(problem, sizeof(problem), "truncated");
 	}
 
-	if (x2 > dest_bitmap.w)
-		x2 = dest_bitmap.w;
+	for (int i = 0; !*problem && i < header->n_entries; ++i) {
+		Pack_Entry *entry = &entries[i];
+		long long nbytes = (long long)entry->w * entry->h * 4;
+		char name[sizeof(entry->name)];
 
-	if (y2 > dest_bitmap.h)
-		y2 = dest_bitmap.h;
+		memcpy(name, entry->name, sizeof(name));
+		name[sizeof(name) - 1] = '\0';
 
-	unsigned int *src = (unsigned int *)src_bitmap.data + (y_off * src_bitmap.w);
-	unsigned int *dest = (unsigned int *)dest_bitmap.data + (y1 * dest_bitmap.w);
+		Sprite *sprite = find_sprite(name);
+		int id = strcmp(name, "chars") == 0 ? n_sprites : (sprite ? sprite - sprites : -1);
 
-	for (int y = y1; y < y2; ++y) {
-		for (int x = x1; x < x2; ++x) {
-			unsigned int color = *(src + (x - x1) + x_off);
-			if (override_color > -1)
-				color = (override_color << 8) | (color & 0xff);
-			lerp_color(color, dest + x);
+		if (entry->w <= 0 || entry->h <= 0 ||
+			!pack_range(st.st_size, entry->offset[right], nbytes) ||
+			(sprite && (!entry->offset[left] || !pack_range(st.st_size, entry->offset[left], nbytes)))) {
+			snprintf(problem, sizeof(problem), "bad entry for %s", name);
+		} else if (id >= 0) {
+			found[id] = entry;
 		}
+	}
 
-		src += src_bitmap.w;
-		dest += dest_bitmap.w;
+	for (int id = 0; !*problem && id <= n_sprites; ++id) {
+		if (!found[id])
+			snprintf(problem, sizeof(problem), "no %s", id < n_sprites ? sprite_names[id] : "chars");
 	}
-}
 
-Bitmap scale_bitmap(Bitmap bitmap, float scale)
-{
-	uint32_t w = bitmap.w;
-	uint32_t h = bitmap.h;
+	if (*problem) {
+		fprintf(stderr, "%s: %s, loading assets/ instead\n", filename, problem);
+		munmap(pack, st.st_size);
+		return false;
+	}
 
-	float w_scaled = (float)w * scale;
-	float h_scaled = (float)h * scale;
+	for (int id = 0; id < n_sprites; ++id) {
+		sprites[id].bitmap[right] = pack_bitmap(pack, found[id], right);
+		sprites[id].bitmap[left] = pack_bitmap(pack, found[id], left);
+	}
 
-	float w_ratio = (float)w / w_scaled;
-	float h_ratio = (float)h / h_scaled;
+	chars_bitmap = pack_bitmap(pack, found[n_sprites], right);
+	level_data = pack + header->level_offset;
+	level_size = header->level_size;
 
-	Bitmap scaled_bitmap;
+	return true;
+}
 
-	scaled_bitmap.data = malloc((int)w_scaled * (int)h_scaled * 4);
-	scaled_bitmap.w = (int)(w_scaled);
-	scaled_bitmap.h = (int)(h_scaled);
+/* Returns false, having said what is missing or malformed, if there is
+ * no pack and the loose files can't all be read. */
+bool load_assets()
+{
+	init_sprite_table();
 
-	uint32_t* dest = (uint32_t*)scaled_bitmap.data;
+	if (!load_pack(PACK_FILE)) {
+		if (!load_win_bmps())
+			return false;
 
-	for (int y = 0; y < scaled_bitmap.h; ++y) {
-		int y_stride = (int)(y * h_ratio) * bitmap.w;
-		for (int x = 0; x < scaled_bitmap.w; ++x) {
-			uint32_t* src = (uint32_t*)bitmap.data + y_stride + (int)(x * w_ratio);
-			*(dest + x) = *src;
-		}
-		dest += scaled_bitmap.w;
+		level_data = read_file("entities.dat", &level_size);
+
+		if (!level_data)
+			return false;
 	}
 
-	return scaled_bitmap;
+	return index_levels();
 }
 
-void draw_string(
-	Bitmap dest_bitmap,
-	int32_t x, int32_t y,
-	const char* s,
-	float scale,
-	int32_t color,
-	int center)
+void clear_bitmap(Bitmap bitmap, unsigned int color)
 {
-	float char_width = 7 * scale;
-	float char_height = 10 * scale;
+	for (int y = 0; y < bitmap.h; ++y) {
+		unsigned int *bitmap_p = (unsigned int *)(bitmap.data + (y * bitmap.pitch));
 
-	if (center) {
-		x += DISPLAY_WIDTH * 0.5;
-		y += DISPLAY_HEIGHT * 0.5;
-		x -= roundf((strlen(s) * 0.5f) * char_width);
-		y -= roundf(char_height * 0.5);
+		for (int x = 0; x < bitmap.w; ++x) {
+			*bitmap_p++ = color;
+		}
 	}
+}
 
-	Bitmap scaled_chars = scale_bitmap(chars_bitmap, scale);
+unsigned int blend_channel(unsigned int s, unsigned int d, unsigned int a)
+{
+	/* Rounded (s * a + d * (255 - a)) / 255 without a divide. Exact for
+	 * all 8-bit inputs, and what the SIMD kernels compute per lane. */
+	unsigned int x = (s * a) + (d * (255 - a)) + 128;
+	return (x + (x >> 8)) >> 8;
+}
 
-	for (int i = 0; *(s + i); ++i) {
-		if (*(s + i) == ' ')
-			continue;
+void lerp_color(unsigned int src, unsigned int *dest)
+{
+	unsigned int a = src & 0xff;
 
-		float bitmap_index = (float)(*(s + i) - 33) * char_width + (2.0 * scale);
+	if (a == 0) return;
 
-		draw_bitmap(
-			scaled_chars, dest_bitmap,
-			x + (i * char_width), y,
-			bitmap_index, 0,
-			-scaled_chars.w + bitmap_index + char_width, -scaled_chars.h + char_height,
-			color);
+	if (a < 255) {
+		unsigned int dest_color = *dest;
+		unsigned int b = blend_channel(src >> 24 & 0xff, dest_color >> 24 & 0xff, a);
+		unsigned int g = blend_channel(src >> 16 & 0xff, dest_color >> 16 & 0xff, a);
+		unsigned int r = blend_channel(src >> 8 & 0xff, dest_color >> 8 & 0xff, a);
+		*dest = b << 24 | g << 16 | r << 8 | a;
+	} else {
+		*dest = src;
 	}
+}
 
-	free(scaled_chars.data);
+/* Scalar reference for the span kernels below; they must match it
+ * bit for bit. */
+void blend_span_scalar(unsigned int *dest, const unsigned int *src, int n, int override_color)
+{
+	for (int x = 0; x < n; ++x) {
+		unsigned int color = src[x];
+		if (override_color > -1)
+			color = ((unsigned int)override_color << 8) | (color & 0xff);
+		lerp_color(color, dest + x);
+	}
 }
 
-void init_display()
+void (*blend_span)(unsigned int *, const unsigned int *, int, int) = blend_span_scalar;
+
+#ifdef HAVE_X86_SIMD
+/* SSE2 is only a given on x86-64. */
+__attribute__((target("sse2")))
+void blend_span_sse2(unsigned int *dest, const unsigned int *src, int n, int override_color)
 {
-	display.w = DISPLAY_WIDTH;
-	display.h = DISPLAY_HEIGHT;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_mask = _mm_set1_epi32(0xff);
+	const __m128i tint = _mm_set1_epi32((int)((unsigned)override_color << 8));
+	const __m128i max = _mm_set1_epi16(255);
+	const __m128i half = _mm_set1_epi16(128);
+	int x = 0;
+
+	for (; x + 4 <= n; x += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+
+		if (override_color > -1)
+			s = _mm_or_si128(_mm_and_si128(s, alpha_mask), tint);
+
+		__m128i a = _mm_and_si128(s, alpha_mask);
+		__m128i transparent = _mm_cmpeq_epi32(a, zero);
+		int n_transparent = _mm_movemask_epi8(transparent);
+
+		if (n_transparent == 0xffff)
+			continue;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha_mask)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dest + x), s);
+			continue;
+		}
+
+		__m128i d = _mm_loadu_si128((const __m128i *)(dest + x));
+		__m128i s_lo = _mm_unpacklo_epi8(s, zero);
+		__m128i s_hi = _mm_unpackhi_epi8(s, zero);
+		__m128i d_lo = _mm_unpacklo_epi8(d, zero);
+		__m128i d_hi = _mm_unpackhi_epi8(d, zero);
+		__m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0), 0);
+		__m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0), 0);
+
+		__m128i t_lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo),
+			_mm_mullo_epi16(d_lo, _mm_sub_epi16(max, a_lo))), half);
+		__m128i t_hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi),
+			_mm_mullo_epi16(d_hi, _mm_sub_epi16(max, a_hi))), half);
+		t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+		t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+		__m128i res = _mm_packus_epi16(t_lo, t_hi);
+		res = _mm_or_si128(_mm_andnot_si128(alpha_mask, res), a);
+
+		if (n_transparent)
+			res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, res));
+
+		_mm_storeu_si128((__m128i *)(dest + x), res);
+	}
+
+	blend_span_scalar(dest + x, src + x, n - x, override_color);
+}
+
+__attribute__((target("avx2")))
+void blend_span_avx2(unsigned int *dest, const unsigned int *src, int n, int override_color)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_mask = _mm256_set1_epi32(0xff);
+	const __m256i tint = _mm256_set1_epi32((int)((unsigned)override_color << 8));
+	const __m256i max = _mm256_set1_epi16(255);
+	const __m256i half = _mm256_set1_epi16(128);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+
+		if (override_color > -1)
+			s = _mm256_or_si256(_mm256_and_si256(s, alpha_mask), tint);
+
+		__m256i a = _mm256_and_si256(s, alpha_mask);
+		__m256i transparent = _mm256_cmpeq_epi32(a, zero);
+		unsigned int n_transparent = _mm256_movemask_epi8(transparent);
+
+		if (n_transparent == 0xffffffff)
+			continue;
+
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, alpha_mask)) == 0xffffffff) {
+			_mm256_storeu_si256((__m256i *)(dest + x), s);
+			continue;
+		}
+
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dest + x));
+		__m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+		__m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+		__m256i d_lo = _mm256_unpacklo_epi8(d, zero);
+		__m256i d_hi = _mm256_unpackhi_epi8(d, zero);
+		__m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0), 0);
+		__m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0), 0);
+
+		__m256i t_lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_lo, a_lo),
+			_mm256_mullo_epi16(d_lo, _mm256_sub_epi16(max, a_lo))), half);
+		__m256i t_hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_hi, a_hi),
+			_mm256_mullo_epi16(d_hi, _mm256_sub_epi16(max, a_hi))), half);
+		t_lo = _mm256_srli_epi16(_mm256_add_epi16(t_lo, _mm256_srli_epi16(t_lo, 8)), 8);
+		t_hi = _mm256_srli_epi16(_mm256_add_epi16(t_hi, _mm256_srli_epi16(t_hi, 8)), 8);
+
+		__m256i res = _mm256_packus_epi16(t_lo, t_hi);
+		res = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, res), a);
+
+		if (n_transparent)
+			res = _mm256_or_si256(_mm256_and_si256(transparent, d), _mm256_andnot_si256(transparent, res));
+
+		_mm256_storeu_si256((__m256i *)(dest + x), res);
+	}
+
+	blend_span_sse2(dest + x, src + x, n - x, override_color);
+}
+#endif
+
+void init_blend()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		blend_span = blend_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		blend_span = blend_span_sse2;
+#endif
+}
+
+Bitmap flip_bitmap(Bitmap bitmap)
+{
+	Bitmap flipped_bitmap;
+	flipped_bitmap.w = bitmap.w;
+	flipped_bitmap.h = bitmap.h;
+	flipped_bitmap.pitch = bitmap.w * 4;
+	flipped_bitmap.nbytes = bitmap.nbytes;
+	flipped_bitmap.data = (unsigned char *)malloc(bitmap.nbytes);
+
+	for (int y = 0; y < bitmap.h; ++y) {
+		unsigned int *src = (unsigned int *)bitmap.data + (y * bitmap.w);
+		unsigned int *dest = (unsigned int *)flipped_bitmap.data + (y * bitmap.w);
+
+		for (int x = 0; x < bitmap.w; ++x) {
+			*(dest + x) = *(src + ((bitmap.w - 1) - x));
+		}
+	}
+
+	return flipped_bitmap;
+}
+
+void draw_bitmap_clipped(
+	Bitmap src_bitmap,
+	Bitmap dest_bitmap,
+	int dx, int dy,
+	int32_t sx_off, int32_t sy_off,
+	int32_t sw_off, int32_t sh_off,
+	int override_color,
+	Rect clip)
+{
+	int x1 = dx;
+	int y1 = dy;
+	int x2 = dx + src_bitmap.w - sx_off + sw_off;
+	int y2 = dy + src_bitmap.h - sy_off + sh_off;
+	int x_off = sx_off;
+	int y_off = sy_off;
+
+	if (x1 < clip.x) {
+		x_off += clip.x - x1;
+		x1 = clip.x;
+	}
+
+	if (y1 < clip.y) {
+		y_off += clip.y - y1;
+		y1 = clip.y;
+	}
+
+	if (x2 > clip.x + clip.w)
+		x2 = clip.x + clip.w;
+
+	if (y2 > clip.y + clip.h)
+		y2 = clip.y + clip.h;
+
+	unsigned char *src = src_bitmap.data + (y_off * src_bitmap.pitch);
+	unsigned char *dest = dest_bitmap.data + (y1 * dest_bitmap.pitch);
+
+	for (int y = y1; y < y2; ++y) {
+		blend_span((unsigned int *)dest + x1, (unsigned int *)src + x_off, x2 - x1, override_color);
+
+		src += src_bitmap.pitch;
+		dest += dest_bitmap.pitch;
+	}
+}
+
+void draw_bitmap(
+	Bitmap src_bitmap,
+	Bitmap dest_bitmap,
+	int dx, int dy,
+	int32_t sx_off, int32_t sy_off,
+	int32_t sw_off, int32_t sh_off,
+	int override_color)
+{
+	Rect clip = {0, 0, dest_bitmap.w, dest_bitmap.h};
+	draw_bitmap_clipped(src_bitmap, dest_bitmap, dx, dy, sx_off, sy_off, sw_off, sh_off, override_color, clip);
+}
+
+Rect intersect_rects(Rect a, Rect b)
+{
+	Rect r;
+	r.x = a.x > b.x ? a.x : b.x;
+	r.y = a.y > b.y ? a.y : b.y;
+	r.w = (a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w) - r.x;
+	r.h = (a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h) - r.y;
+
+	if (r.w < 0) r.w = 0;
+	if (r.h < 0) r.h = 0;
+
+	return r;
+}
+
+Rect union_rects(Rect a, Rect b)
+{
+	Rect r;
+	r.x = a.x < b.x ? a.x : b.x;
+	r.y = a.y < b.y ? a.y : b.y;
+	r.w = (a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w) - r.x;
+	r.h = (a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h) - r.y;
+	return r;
+}
+
+/* Same arguments as draw_bitmap, onto the display, deferred until
+ * compose_frame. */
+void push_draw_command(
+	Bitmap src_bitmap,
+	int dx, int dy,
+	int32_t sx_off, int32_t sy_off,
+	int32_t sw_off, int32_t sh_off,
+	int override_color)
+{
+	Memory *list = draw_target;
+	Rect screen = {0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT};
+	Rect area = {dx, dy, src_bitmap.w - sx_off + sw_off, src_bitmap.h - sy_off + sh_off};
+	Draw_Command command = {
+		src_bitmap, dx, dy, sx_off, sy_off, sw_off, sh_off, override_color,
+		intersect_rects(screen, area)
+	};
+
+	if (command.rect.w == 0 || command.rect.h == 0)
+		return;
+
+	assert(list->n_elems < list->max_elems);
+	push_memory(list, &command);
+}
+
+void draw_commands(Memory list, Bitmap dest_bitmap, Rect clip)
+{
+	Draw_Command *commands = get_memory_block(list);
+
+	for (int i = 0; i < list.n_elems; ++i) {
+		Draw_Command *c = &commands[i];
+		Rect r = intersect_rects(c->rect, clip);
+
+		if (r.w && r.h) {
+			draw_bitmap_clipped(
+				c->bitmap, dest_bitmap,
+				c->x, c->y,
+				c->sx_off, c->sy_off, c->sw_off, c->sh_off,
+				c->color, r);
+		}
+	}
+}
+
+Bitmap scale_bitmap(Bitmap bitmap, float scale)
+{
+	uint32_t w = bitmap.w;
+	uint32_t h = bitmap.h;
+
+	float w_scaled = (float)w * scale;
+	float h_scaled = (float)h * scale;
+
+	float w_ratio = (float)w / w_scaled;
+	float h_ratio = (float)h / h_scaled;
+
+	Bitmap scaled_bitmap;
+
+	scaled_bitmap.data = malloc((int)w_scaled * (int)h_scaled * 4);
+	scaled_bitmap.w = (int)(w_scaled);
+	scaled_bitmap.h = (int)(h_scaled);
+	scaled_bitmap.pitch = scaled_bitmap.w * 4;
+
+	uint32_t* dest = (uint32_t*)scaled_bitmap.data;
+
+	for (int y = 0; y < scaled_bitmap.h; ++y) {
+		int y_stride = (int)(y * h_ratio) * bitmap.w;
+		for (int x = 0; x < scaled_bitmap.w; ++x) {
+			uint32_t* src = (uint32_t*)bitmap.data + y_stride + (int)(x * w_ratio);
+			*(dest + x) = *src;
+		}
+		dest += scaled_bitmap.w;
+	}
+
+	return scaled_bitmap;
+}
+
+Glyph_Atlas *get_glyph_atlas(float scale)
+{
+	for (int i = 0; i < n_glyph_atlases; ++i) {
+		if (glyph_atlases[i].scale == scale) {
+			return &glyph_atlases[i];
+		}
+	}
+
+	Glyph_Atlas *atlas;
+
+	if (n_glyph_atlases < MAX_GLYPH_ATLASES) {
+		atlas = &glyph_atlases[n_glyph_atlases++];
+	} else {
+		/* Last frame's commands may still point at this bitmap, and a
+		 * new one at the same address would pass for them in
+		 * compose_frame, so the next frame is redrawn in full. */
+		atlas = &glyph_atlases[MAX_GLYPH_ATLASES - 1];
+		free(atlas->bitmap.data);
+		full_redraw = true;
+	}
+
+	float char_width = 7 * scale;
+	float char_height = 10 * scale;
+
+	atlas->scale = scale;
+	atlas->bitmap = scale_bitmap(chars_bitmap, scale);
+	atlas->sh_off = -atlas->bitmap.h + char_height;
+
+	for (int i = 0; i < N_GLYPHS; ++i) {
+		float bitmap_index = (float)i * char_width + (2.0 * scale);
+		atlas->glyph[i].sx_off = bitmap_index;
+		atlas->glyph[i].sw_off = -atlas->bitmap.w + bitmap_index + char_width;
+	}
+
+	return atlas;
+}
+
+long long profile_begin()
+{
+	return profile_ring ? now_ns() : 0;
+}
+
+void profile_record(enum Phase phase, long long start, long long end)
+{
+	Profile_Event *event = &profile_ring->events[profile_ring->n++ & (PROFILE_EVENTS - 1)];
+	event->start = start;
+	event->end = end;
+	event->phase = phase;
+
+	long long avg = atomic_load(&phase_avg[phase]);
+	atomic_store(&phase_avg[phase], avg + ((end - start) - avg) / 16);
+}
+
+void profile_end(enum Phase phase, long long start)
+{
+	if (profile_ring)
+		profile_record(phase, start, now_ns());
+}
+
+/* The entity loop interleaves its phases per entity, so instead of one
+ * span each it charges the time since the last switch to the phase that
+ * was running and returns that phase, for the caller to switch back. */
+enum Phase profile_switch(enum Phase phase)
+{
+	enum Phase old_phase = current_phase;
+
+	if (profile_ring) {
+		long long t = now_ns();
+		phase_sum[current_phase] += t - phase_mark;
+		phase_mark = t;
+	}
+
+	current_phase = phase;
+	return old_phase;
+}
+
+/* Starts charging time to phase, from zeroed sums. */
+void profile_open(enum Phase phase)
+{
+	memset(phase_sum, 0, sizeof(phase_sum));
+	current_phase = phase;
+	phase_mark = profile_begin();
+}
+
+/* Records each charged phase as one event, laid end to end from start. */
+void profile_close(long long start)
+{
+	if (!profile_ring)
+		return;
+
+	profile_switch(current_phase);
+
+	for (int i = 0; i < n_phases; ++i) {
+		if (phase_sum[i]) {
+			profile_record(i, start, start + phase_sum[i]);
+			start += phase_sum[i];
+		}
+	}
+}
+
+/* basename.json loads in chrome://tracing or Perfetto, basename.csv is
+ * one row per event. Call once the profiled threads have stopped. */
+void write_profile(const char *basename)
+{
+	char filename[256];
+	FILE *json, *csv;
+
+	snprintf(filename, sizeof(filename), "%s.json", basename);
+	json = fopen(filename, "w");
+	snprintf(filename, sizeof(filename), "%s.csv", basename);
+	csv = fopen(filename, "w");
+
+	if (!json || !csv) {
+		fprintf(stderr, "can't write profile %s\n", basename);
+		if (json)
+			fclose(json);
+		if (csv)
+			fclose(csv);
+		return;
+	}
+
+	fprintf(json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(csv, "thread,phase,start_us,duration_us\n");
+
+	for (int t = 0; t < array_size(profile_rings); ++t) {
+		Profile_Ring *ring = &profile_rings[t];
+		unsigned int first = ring->n > PROFILE_EVENTS ? ring->n - PROFILE_EVENTS : 0;
+
+		fprintf(json, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			t ? ",\n" : "", t, ring->name);
+
+		for (unsigned int i = first; i < ring->n; ++i) {
+			Profile_Event *event = &ring->events[i & (PROFILE_EVENTS - 1)];
+			double start = (event->start - profile_epoch) / 1000.0;
+			double duration = (event->end - event->start) / 1000.0;
+
+			fprintf(json, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				phase_names[event->phase], t, start, duration);
+			fprintf(csv, "%s,%s,%.3f,%.3f\n", ring->name, phase_names[event->phase], start, duration);
+		}
+	}
+
+	fprintf(json, "\n]}\n");
+	fclose(json);
+	fclose(csv);
+}
+
+void draw_string(
+	int32_t x, int32_t y,
+	const char* s,
+	float scale,
+	int32_t color,
+	int center)
+{
+	float char_width = 7 * scale;
+	float char_height = 10 * scale;
+
+	if (center) {
+		x += DISPLAY_WIDTH * 0.5;
+		y += DISPLAY_HEIGHT * 0.5;
+		x -= roundf((strlen(s) * 0.5f) * char_width);
+		y -= roundf(char_height * 0.5);
+	}
+
+	Glyph_Atlas *atlas = get_glyph_atlas(scale);
+
+	for (int i = 0; *(s + i); ++i) {
+		int c = *(s + i) - FIRST_GLYPH;
+
+		if (c < 0 || c >= N_GLYPHS)
+			continue;
+
+		push_draw_command(
+			atlas->bitmap,
+			x + (i * char_width), y,
+			atlas->glyph[c].sx_off, 0,
+			atlas->glyph[c].sw_off, atlas->sh_off,
+			color);
+	}
+}
+
+bool display_scaled()
+{
+	return display.scale > 1;
+}
+
+#ifndef BURGER_LIB
+void init_display()
+{
+	display.w = DISPLAY_WIDTH;
+	display.h = DISPLAY_HEIGHT;
 	SDL_Init(SDL_INIT_VIDEO);
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
 	display.window = SDL_CreateWindow(
 						 "Burger Girl",
 						 SDL_WINDOWPOS_CENTERED,
@@ -696,1156 +1837,3433 @@ void init_display()
 						 display.w, display.h,
 						 0);
 	display.renderer = SDL_CreateRenderer(
-						   display.window, -1, SDL_RENDERER_ACCELERATED);
+						   display.window, -1,
+						   SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 	display.texture = SDL_CreateTexture(display.renderer,
 						  SDL_PIXELFORMAT_RGBA8888,
 						  SDL_TEXTUREACCESS_STREAMING,
-						  display.w, display.h);
+						  display.w * display.scale, display.h * display.scale);
 	SDL_SetWindowPosition(display.window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
-	SDL_RenderSetLogicalSize(display.renderer, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+	SDL_RenderSetLogicalSize(display.renderer, display.w * display.scale, display.h * display.scale);
 	//SDL_SetWindowFullscreen(display.window, SDL_WINDOW_FULLSCREEN_DESKTOP);
-	SDL_SetWindowSize(display.window, DISPLAY_WIDTH * 2, DISPLAY_HEIGHT * 2);
+
+	if (display_scaled())
+		SDL_SetWindowSize(display.window, display.w * display.scale, display.h * display.scale);
+	else
+		SDL_SetWindowSize(display.window, DISPLAY_WIDTH * 2, DISPLAY_HEIGHT * 2);
+}
+
+/* At scale 1, points display_bitmap at the streaming texture's memory
+ * for r, offset so that display coordinates still address it, and
+ * compose_frame draws there directly. SDL doesn't promise the locked
+ * memory holds the old pixels, so every pixel of r must be written
+ * before it is read: rasterize_rows restores the whole rect from the
+ * base before any command blends into it. Scaled output is composed in
+ * display_bitmap and scaled in by blit_display instead, and without a
+ * window display_bitmap is plain memory and stays put. */
+bool lock_display(Rect r)
+{
+	SDL_Rect rect = {r.x, r.y, r.w, r.h};
+	void *pixels;
+	int pitch;
+
+	if (!display.texture || display_scaled())
+		return true;
+
+	if (SDL_LockTexture(display.texture, &rect, &pixels, &pitch) != 0)
+		return false;
+
+	display_bitmap.data = (unsigned char *)pixels - (r.y * pitch) - (r.x * 4);
+	display_bitmap.pitch = pitch;
+	return true;
+}
+
+void unlock_display()
+{
+	if (display.texture && !display_scaled())
+		SDL_UnlockTexture(display.texture);
+}
+#else
+/* The library has no window to draw into. */
+bool lock_display(Rect r)
+{
+	(void)r;
+	return true;
+}
+
+void unlock_display()
+{
+}
+#endif
+
+/* Nearest-neighbour: each source pixel repeated scale times along the
+ * row. The caller repeats the row itself. */
+void scale_row_scalar(unsigned int *dest, const unsigned int *src, int n, int scale)
+{
+	for (int x = 0; x < n; ++x) {
+		for (int i = 0; i < scale; ++i) {
+			*dest++ = src[x];
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void scale_row_sse2(unsigned int *dest, const unsigned int *src, int n, int scale)
+{
+	int x = 0;
+
+	if (scale == 2) {
+		for (; x + 4 <= n; x += 4, dest += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+			_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi32(v, v));
+			_mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi32(v, v));
+		}
+	} else if (scale == 3) {
+		for (; x + 4 <= n; x += 4, dest += 12) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+			_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+			_mm_storeu_si128((__m128i *)(dest + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+			_mm_storeu_si128((__m128i *)(dest + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+		}
+	} else if (scale == 4) {
+		for (; x + 4 <= n; x += 4, dest += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+			_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+			_mm_storeu_si128((__m128i *)(dest + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+			_mm_storeu_si128((__m128i *)(dest + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+			_mm_storeu_si128((__m128i *)(dest + 12), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+		}
+	}
+
+	scale_row_scalar(dest, src + x, n - x, scale);
+}
+#endif
+
+void (*scale_row)(unsigned int *, const unsigned int *, int, int) = scale_row_scalar;
+
+/* Scale2x/EPX for pixels x1..x2 of one row: each pixel becomes 2x2, and
+ * a corner takes a neighbour's colour where two neighbours meeting there
+ * agree and the other two don't. Neighbours past the display edge are
+ * the pixel itself. */
+void epx_row_scalar(
+	unsigned int *out0, unsigned int *out1,
+	const unsigned int *above, const unsigned int *row, const unsigned int *below,
+	int x1, int x2)
+{
+	for (int x = x1; x < x2; ++x) {
+		unsigned int p = row[x];
+		unsigned int a = above[x];
+		unsigned int d = below[x];
+		unsigned int c = x > 0 ? row[x - 1] : p;
+		unsigned int b = x < DISPLAY_WIDTH - 1 ? row[x + 1] : p;
+		int i = (x - x1) * 2;
+
+		out0[i] = (c == a && c != d && a != b) ? a : p;
+		out0[i + 1] = (a == b && a != c && b != d) ? b : p;
+		out1[i] = (d == c && d != b && c != a) ? c : p;
+		out1[i + 1] = (b == d && b != a && d != c) ? d : p;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void epx_row_sse2(
+	unsigned int *out0, unsigned int *out1,
+	const unsigned int *above, const unsigned int *row, const unsigned int *below,
+	int x1, int x2)
+{
+	int x = x1;
+
+	if (x == 0) {
+		epx_row_scalar(out0, out1, above, row, below, 0, 1);
+		x = 1;
+	}
+
+	/* Four pixels at a time while x + 4 is still on the display. */
+	for (; x + 4 <= x2 && x + 4 < DISPLAY_WIDTH; x += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+		__m128i a = _mm_loadu_si128((const __m128i *)(above + x));
+		__m128i d = _mm_loadu_si128((const __m128i *)(below + x));
+		__m128i c = _mm_loadu_si128((const __m128i *)(row + x - 1));
+		__m128i b = _mm_loadu_si128((const __m128i *)(row + x + 1));
+		__m128i ca = _mm_cmpeq_epi32(c, a);
+		__m128i ab = _mm_cmpeq_epi32(a, b);
+		__m128i dc = _mm_cmpeq_epi32(d, c);
+		__m128i bd = _mm_cmpeq_epi32(b, d);
+		__m128i m1 = _mm_andnot_si128(dc, _mm_andnot_si128(ab, ca));
+		__m128i m2 = _mm_andnot_si128(ca, _mm_andnot_si128(bd, ab));
+		__m128i m3 = _mm_andnot_si128(bd, _mm_andnot_si128(ca, dc));
+		__m128i m4 = _mm_andnot_si128(ab, _mm_andnot_si128(dc, bd));
+		__m128i e1 = _mm_or_si128(_mm_and_si128(m1, a), _mm_andnot_si128(m1, p));
+		__m128i e2 = _mm_or_si128(_mm_and_si128(m2, b), _mm_andnot_si128(m2, p));
+		__m128i e3 = _mm_or_si128(_mm_and_si128(m3, c), _mm_andnot_si128(m3, p));
+		__m128i e4 = _mm_or_si128(_mm_and_si128(m4, d), _mm_andnot_si128(m4, p));
+		int i = (x - x1) * 2;
+
+		_mm_storeu_si128((__m128i *)(out0 + i), _mm_unpacklo_epi32(e1, e2));
+		_mm_storeu_si128((__m128i *)(out0 + i + 4), _mm_unpackhi_epi32(e1, e2));
+		_mm_storeu_si128((__m128i *)(out1 + i), _mm_unpacklo_epi32(e3, e4));
+		_mm_storeu_si128((__m128i *)(out1 + i + 4), _mm_unpackhi_epi32(e3, e4));
+	}
+
+	epx_row_scalar(out0 + (x - x1) * 2, out1 + (x - x1) * 2, above, row, below, x, x2);
+}
+#endif
+
+void (*epx_row)(unsigned int *, unsigned int *, const unsigned int *, const unsigned int *,
+			   const unsigned int *, int, int) = epx_row_scalar;
+
+void init_upscale()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		scale_row = scale_row_sse2;
+		epx_row = epx_row_sse2;
+	}
+#endif
+}
+
+#ifndef BURGER_LIB
+/* Writes r of display_bitmap, scaled, into the texture. EPX output
+ * depends on each pixel's neighbours, so the caller grows r by one. */
+bool upscale_rect(Rect r)
+{
+	int scale = display.scale;
+	SDL_Rect rect = {r.x * scale, r.y * scale, r.w * scale, r.h * scale};
+	void *pixels;
+	int pitch;
+
+	if (SDL_LockTexture(display.texture, &rect, &pixels, &pitch) != 0)
+		return false;
+
+	for (int y = r.y; y < r.y + r.h; ++y) {
+		unsigned char *out = (unsigned char *)pixels + ((y - r.y) * scale * pitch);
+		const unsigned int *row = (const unsigned int *)(display_bitmap.data + (y * display_bitmap.pitch));
+
+		if (display.epx) {
+			const unsigned int *above = y > 0 ? (const unsigned int *)((const unsigned char *)row - display_bitmap.pitch) : row;
+			const unsigned int *below = y < DISPLAY_HEIGHT - 1 ? (const unsigned int *)((const unsigned char *)row + display_bitmap.pitch) : row;
+			epx_row((unsigned int *)out, (unsigned int *)(out + pitch), above, row, below, r.x, r.x + r.w);
+		} else {
+			/* Every copy of the row from the source: texture memory is
+			 * never read back. */
+			for (int i = 0; i < scale; ++i)
+				scale_row((unsigned int *)(out + (i * pitch)), row + r.x, r.w, scale);
+		}
+	}
+
+	SDL_UnlockTexture(display.texture);
+	return true;
+}
+
+/* At scale 1 the dirty rects are already in the texture; scaled, they
+ * are scaled in from display_bitmap here. Returns whether anything was
+ * presented. A rect that can't be locked is left for a full redraw next
+ * frame. */
+bool blit_display()
+{
+	Rect screen = {0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT};
+
+	if (!n_dirty_rects)
+		return false;
+
+	for (int i = 0; display_scaled() && i < n_dirty_rects; ++i) {
+		Rect r = dirty_rects[i];
+
+		if (display.epx)
+			r = intersect_rects((Rect){r.x - 1, r.y - 1, r.w + 2, r.h + 2}, screen);
+
+		if (!upscale_rect(r))
+			full_redraw = true;
+	}
+
+	SDL_RenderCopy(display.renderer, display.texture, NULL, NULL);
+	SDL_RenderPresent(display.renderer);
+	return true;
+}
+
+void get_input(Input *input)
+{
+	SDL_Event event;
+	SDL_PumpEvents();
+
+	/* Frames where nothing changed aren't presented, so repaint
+	 * everything once the window has been exposed, resized or moved. */
+	while (SDL_PeepEvents(&event, 1, SDL_GETEVENT, SDL_WINDOWEVENT, SDL_WINDOWEVENT) > 0) {
+		full_redraw = true;
+	}
+
+	const unsigned char *state = SDL_GetKeyboardState(NULL);
+	input->key_up = state[SDL_SCANCODE_UP];
+	input->key_down = state[SDL_SCANCODE_DOWN];
+	input->key_left = state[SDL_SCANCODE_LEFT];
+	input->key_right = state[SDL_SCANCODE_RIGHT];
+	input->key_a = state[SDL_SCANCODE_A];
+	input->key_c = state[SDL_SCANCODE_C];
+	input->key_d = state[SDL_SCANCODE_D];
+	input->key_q = state[SDL_SCANCODE_Q];
+	input->key_f = state[SDL_SCANCODE_F];
+	input->key_e = state[SDL_SCANCODE_E];
+	input->key_g = state[SDL_SCANCODE_G];
+	input->key_l = state[SDL_SCANCODE_L];
+	input->key_m = state[SDL_SCANCODE_M];
+	input->key_r = state[SDL_SCANCODE_R];
+	input->key_s = state[SDL_SCANCODE_S];
+	input->key_ctrl = state[SDL_SCANCODE_LCTRL];
+	input->key_lshift = state[SDL_SCANCODE_LSHIFT];
+	input->key_space = state[SDL_SCANCODE_SPACE];
+	input->key_tab = state[SDL_SCANCODE_TAB];
+	input->key_return = state[SDL_SCANCODE_RETURN];
+}
+#endif
+
+V2 get_accel(MotionInput motion_input)
+{
+	V2 a = {0.0f, 0.0f};
+
+	if (motion_input.up)
+		a.y = -1.0f;
+
+	if (motion_input.down)
+		a.y = 1.0f;
+
+	if (motion_input.right)
+		a.x = 1.0f;
+
+	if (motion_input.left)
+		a.x = -1.0f;
+
+	return a;
+}
+
+MotionInput get_player_motion_input()
+{
+	MotionInput motion_input = {};
+
+	if (game->input.key_up)
+		motion_input.up = 1;
+
+	if (game->input.key_down)
+		motion_input.down = 1;
+
+	if (game->input.key_left)
+		motion_input.left = 1;
+
+	if (game->input.key_right)
+		motion_input.right = 1;
+
+	if (game->input.key_ctrl && !game->last_input.key_ctrl)
+		motion_input.jump = 1;
+
+	return motion_input;
+}
+
+MotionInput get_npc_motion_input(Entity *entity)
+{
+	MotionInput motion_input = {};
+	float target_x, target_y;
+	Entity *player = get_entity(0);
+
+	if (player) {
+		target_x = player->p.x;
+		target_y = player->p.y;
+	} else {
+		target_x = game_rand() % DISPLAY_WIDTH;
+		target_y = game_rand() % DISPLAY_HEIGHT;
+	}
+
+	Collision *burger_collision;
+	enum EntityType burger_search[4] = {top_bun, tomato, meat, bottom_bun};
+
+	for (int i = 0; i < 4; ++i) {
+		burger_collision = search_collisions(entity, burger_search[i]);
+
+		if (burger_collision && burger_collision->normal.x != 0.0f) {
+			motion_input.jump = 1;
+			break;
+		}
+	}
+
+	if (at_decision_point(entity)) {
+		enum NavStep step = player ? npc_nav_step(entity) : step_none;
+		Collision *ladder_collision = search_collisions(entity, ladder);
+		Collision *platform_collision = search_collisions(entity, platform);
+
+		if (step != step_none) {
+			motion_input.left = step == step_left;
+			motion_input.right = step == step_right;
+			motion_input.up = step == step_up;
+			motion_input.down = step == step_down;
+
+			/* Ladders are only mounted from near their middle. */
+			if ((step == step_up || step == step_down) && ladder_collision && !entity->on_ladder) {
+				float ladder_x = get_entity(ladder_collision->id)->p.x;
+
+				motion_input.left = entity->p.x > ladder_x + 3.0f;
+				motion_input.right = entity->p.x < ladder_x - 3.0f;
+			}
+
+			/* And only left level with the platform. */
+			if ((step == step_left || step == step_right) && entity->on_ladder && platform_collision) {
+				Entity *p = get_entity(platform_collision->id);
+				float feet = entity->p.y + (entity->h * 0.5f);
+				float top = p->p.y - (p->h * 0.5f);
+
+				motion_input.up = feet > top + 1.0f;
+				motion_input.down = feet < top - 1.0f;
+			}
+
+			return motion_input;
+		}
+
+		/* Off the nav graph, head straight for the target. */
+		float x_diff = entity->p.x - target_x;
+		float y_diff = entity->p.y - target_y;
+
+		if (y_diff < 50) {
+			motion_input.down = 1;
+		} else if (y_diff > 50) {
+			motion_input.up = 1;
+		}
+
+		if (x_diff < 0) {
+			motion_input.right = 1;
+		} else if (x_diff > 0) {
+			motion_input.left = 1;
+		}
+	} else {
+		motion_input.left = entity->motion_input.left;
+		motion_input.right = entity->motion_input.right;
+		motion_input.up = entity->motion_input.up;
+		motion_input.down = entity->motion_input.down;
+	}
+
+	return motion_input;
+}
+
+#ifndef BURGER_LIB
+void process_ui_input(Input input, Input last_input)
+{
+	if (input.key_q) {
+		running = 0;
+	}
+
+	if (input.key_tab && !last_input.key_tab) {
+		show_profile = !show_profile;
+	}
+
+	if (input.key_f && !last_input.key_f) {
+		dirty_rects[0] = (Rect){0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT};
+		n_dirty_rects = 1;
+
+		if (lock_display(dirty_rects[0])) {
+			clear_bitmap(display_bitmap, 0);
+			unlock_display();
+		}
+
+		blit_display();
+		full_redraw = true;
+		unsigned int fs = SDL_GetWindowFlags(display.window) & SDL_WINDOW_FULLSCREEN_DESKTOP;
+		SDL_SetWindowFullscreen(display.window, fs ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
+	}
+}
+#endif
+
+void vector_set(V2 *v, float x, float y)
+{
+	v->x = x;
+	v->y = y;
+}
+
+float vector_dot_product(V2 v1, V2 v2)
+{
+	float s = (v1.x * v2.x) + (v1.y * v2.y);
+
+	return s;
+}
+
+V2 vector_add(V2 v1, V2 v2)
+{
+	v1.x += v2.x;
+	v1.y += v2.y;
+
+	return v1;
+}
+
+V2 vector_subtract(V2 v1, V2 v2)
+{
+	v1.x -= v2.x;
+	v1.y -= v2.y;
+
+	return v1;
+}
+
+V2 vector_scalar_multiply(V2 v, float s)
+{
+	v.x *= s;
+	v.y *= s;
+
+	return v;
+}
+
+V2 vector_scalar_divide(V2 v, float s)
+{
+	v.x /= s;
+	v.y /= s;
+
+	return v;
+}
+
+V2 vector_normalize(V2 v)
+{
+	float lsq = vector_dot_product(v, v);
+
+	if (lsq > 1.0f) {
+		float l = sqrt(lsq);
+		v = vector_scalar_divide(v, l);
+	}
+
+	return v;
+}
+
+float square(float x)
+{
+	return x * x;
+}
+
+V2 find_normal(Minkowski_Box mink)
+{
+	V2 normal = {};
+	float sides[4][3] = {
+		{fabs(mink.p.y + mink.h), 0.0f, -1.0f},
+		{fabs(mink.p.x + mink.w), -1.0f, 0.0f},
+		{fabs(mink.p.x), 1.0f, 0.0f},
+		{fabs(mink.p.y), 0.0f, 1.0f}
+	};
+	float min = 5.0f;
+
+	for (int i = 0; i < 4; ++i) {
+		if (sides[i][0] < min) {
+			min = sides[i][0];
+			normal.x = sides[i][1];
+			normal.y = sides[i][2];
+		}
+	}
+
+	return normal;
+}
+
+void resolve_collision(V2 old_p, Entity* e1, V2* dt)
+{
+	for (int i = 0; i < e1->n_collisions; ++i) {
+		if (!get_entity(e1->collision[i].id)->permeable) {
+			V2 normal = e1->collision[i].normal;
+
+			if (normal.y != 0.0f) {
+				e1->p.y = old_p.y;
+			} else if (normal.x != 0.0f) {
+				e1->p.x = old_p.x;
+			} else {
+				e1->p = old_p;
+			}
+		}
+	}
+
+	for (int i = 0; i < e1->n_collisions; ++i) {
+		if (!get_entity(e1->collision[i].id)->permeable) {
+			Entity *e2 = get_entity(e1->collision[i].id);
+			V2 normal = e1->collision[i].normal;
+			float t = 1.0f;
+
+			float x1 = e1->p.x, y1 = e1->p.y;
+			float x2 = e2->p.x, y2 = e2->p.y;
+			int w1 = e1->hitbox.x > 0 ? e1->hitbox.x : e1->w;
+			int w2 = e2->hitbox.x > 0 ? e2->hitbox.x : e2->w;
+			int h1 = e1->hitbox.y > 0 ? e1->hitbox.y : e1->h;
+			int h2 = e2->hitbox.y > 0 ? e2->hitbox.y : e2->h;
+
+
+			if (normal.x == 1.0f && dt->x != 0.0f) {
+				t = ((x1 - (w1 * 0.5f)) - (x2 + (w2 * 0.5f))) / fabs(dt->x);
+			} else if (normal.x == -1.0f && dt->x != 0.0f) {
+				t = ((x2 - (w2 * 0.5f)) - (x1 + (w1 * 0.5f))) / fabs(dt->x);
+			} else if (normal.y == 1.0f && dt->y != 0.0f) {
+				t = ((y1 - (h1 * 0.5f)) - (y2 + (h2 * 0.5f))) / fabs(dt->y);
+			} else if (normal.y == -1.0f && dt->y != 0.0f) {
+				t = ((y2 - (h2 * 0.5f)) - (y1 + (h1 * 0.5f))) / fabs(dt->y);
+			}
+
+			int normal_seen = 0;
+
+			for (int j = 0; j < i; ++j) {
+				V2 earlier_normal = e1->collision[j].normal;
+
+				if (earlier_normal.x == normal.x && earlier_normal.y == normal.y) {
+					normal_seen = 1;
+				}
+			}
+
+			if (!normal_seen) {
+				e1->p = vector_add(e1->p, vector_scalar_multiply(*dt, t));
+				e1->v = vector_subtract(e1->v, vector_scalar_multiply(normal, vector_dot_product(e1->v, normal)));
+				*dt = vector_subtract(*dt, vector_scalar_multiply(normal, vector_dot_product(*dt, normal)));
+			}
+		}
+	}
+}
+
+Minkowski_Box calculate_minkowski_sum(const Entity *e1, const Entity *e2)
+{
+	Minkowski_Box mink = {};
+	Minkowski_Box box1 = {e1->p, e1->hitbox.x > 0 ? e1->hitbox.x : e1->w, e1->hitbox.y > 0 ? e1->hitbox.y : e1->h};
+	Minkowski_Box box2 = {e2->p, e2->hitbox.x > 0 ? e2->hitbox.x : e2->w, e2->hitbox.y > 0 ? e2->hitbox.y : e2->h};
+	mink.p.x = (box1.p.x - (box1.w * 0.5f)) - (box2.p.x + (box2.w * 0.5f));
+	mink.p.y = (box1.p.y - (box1.h * 0.5f)) - (box2.p.y + (box2.h * 0.5f));
+	mink.w = box1.w + box2.w;
+	mink.h = box1.h + box2.h;
+
+	return mink;
+}
+
+int is_collision(Minkowski_Box mink)
+{
+	return (
+		mink.p.x <= 0 && mink.p.x + mink.w >= 0 &&
+		mink.p.y <= 0 && mink.p.y + mink.h >= 0
+	);
+}
+
+Grid_Span grid_span(const Entity *e)
+{
+	Grid_Span span;
+	float w = e->hitbox.x > 0 ? e->hitbox.x : e->w;
+	float h = e->hitbox.y > 0 ? e->hitbox.y : e->h;
+
+	/* Pad by a pixel so float rounding in the Minkowski test can never
+	 * reject a pair the grid would have missed. */
+	span.x1 = (int)floorf((e->p.x - (w * 0.5f) - 1.0f) / GRID_CELL_SIZE);
+	span.y1 = (int)floorf((e->p.y - (h * 0.5f) - 1.0f) / GRID_CELL_SIZE);
+	span.x2 = (int)floorf((e->p.x + (w * 0.5f) + 1.0f) / GRID_CELL_SIZE);
+	span.y2 = (int)floorf((e->p.y + (h * 0.5f) + 1.0f) / GRID_CELL_SIZE);
+
+	/* Anything off the display lands in the border cells. Clamping keeps
+	 * overlapping spans overlapping, so no pair is lost. */
+	span.x1 = span.x1 < 0 ? 0 : (span.x1 >= GRID_COLS ? GRID_COLS - 1 : span.x1);
+	span.x2 = span.x2 < 0 ? 0 : (span.x2 >= GRID_COLS ? GRID_COLS - 1 : span.x2);
+	span.y1 = span.y1 < 0 ? 0 : (span.y1 >= GRID_ROWS ? GRID_ROWS - 1 : span.y1);
+	span.y2 = span.y2 < 0 ? 0 : (span.y2 >= GRID_ROWS ? GRID_ROWS - 1 : span.y2);
+
+	return span;
+}
+
+void grid_set(Grid *g, int slot, Grid_Span span, bool set)
+{
+	uint64_t bit = (uint64_t)1 << (slot % 64);
+
+	for (int y = span.y1; y <= span.y2; ++y) {
+		for (int x = span.x1; x <= span.x2; ++x) {
+			if (set)
+				g->cells[y][x][slot / 64] |= bit;
+			else
+				g->cells[y][x][slot / 64] &= ~bit;
+		}
+	}
+}
+
+void grid_query(Grid_Span span, uint64_t *candidates)
+{
+	memset(candidates, 0, GRID_WORDS * sizeof(uint64_t));
+
+	for (int y = span.y1; y <= span.y2; ++y) {
+		for (int x = span.x1; x <= span.x2; ++x) {
+			for (int i = 0; i < GRID_WORDS; ++i) {
+				candidates[i] |= game->grid.cells[y][x][i];
+			}
+		}
+	}
+}
+
+int grid_next_slot(uint64_t *candidates, int slot)
+{
+	for (int i = slot / 64; i < GRID_WORDS; ++i) {
+		uint64_t bits = candidates[i];
+
+		if (i == slot / 64)
+			bits &= ~(uint64_t)0 << (slot % 64);
+
+		if (bits)
+			return i * 64 + __builtin_ctzll(bits);
+	}
+
+	return -1;
+}
+
+void grid_add_entity(Entity *e)
+{
+	int slot = e - (Entity *)game->entities.buffer;
+	game->grid.span[slot] = grid_span(e);
+	grid_set(&game->grid, slot, game->grid.span[slot], true);
+}
+
+void grid_move_entity(Entity *e)
+{
+	int slot = e - (Entity *)game->entities.buffer;
+	Grid_Span span = grid_span(e);
+	Grid_Span old = game->grid.span[slot];
+
+	if (span.x1 != old.x1 || span.y1 != old.y1 || span.x2 != old.x2 || span.y2 != old.y2) {
+		grid_set(&game->grid, slot, old, false);
+		grid_set(&game->grid, slot, span, true);
+		game->grid.span[slot] = span;
+	}
+}
+
+/* Mirrors delete_memory: the last slot is moved into the freed one. */
+void grid_remove_entity(Entity *e)
+{
+	int slot = e - (Entity *)game->entities.buffer;
+	int last = game->entities.n_elems - 1;
+
+	grid_set(&game->grid, slot, game->grid.span[slot], false);
+
+	if (slot != last) {
+		grid_set(&game->grid, last, game->grid.span[last], false);
+		game->grid.span[slot] = game->grid.span[last];
+		grid_set(&game->grid, slot, game->grid.span[slot], true);
+	}
+}
+
+void detect_collisions(Entity *entity)
+{
+	int old_n_collisions = entity->n_collisions;
+	int old_collision_ids[old_n_collisions];
+
+	for (int i = 0; i < old_n_collisions; ++i) {
+		old_collision_ids[i] = entity->collision[i].id;
+	}
+
+	V2 normal = {};
+	entity->n_collisions = 0;
+
+	uint64_t candidates[GRID_WORDS];
+	grid_query(grid_span(entity), candidates);
+
+	for (int slot = grid_next_slot(candidates, 0); slot >= 0; slot = grid_next_slot(candidates, slot + 1)) {
+		Entity *other_entity = (Entity *)game->entities.buffer + slot;
+
+		if (entity->id != other_entity->id) {
+			Minkowski_Box mink = calculate_minkowski_sum(entity, other_entity);
+
+			if (is_collision(mink)) {
+				normal = find_normal(mink);
+
+				Collision collision;
+				collision.id = other_entity->id;
+				collision.type = other_entity->type;
+				collision.normal = normal;
+				collision.mink = mink;
+				collision.new = true;
+
+				for (int i = 0; i < old_n_collisions; ++i) {
+					if (collision.id == old_collision_ids[i]) {
+						collision.new = false;
+					}
+				}
+
+				/* In a crowd the extra contacts are other NPCs, which come
+				 * after the level's own entities in slot order. */
+				if (entity->n_collisions < array_size(entity->collision)) {
+					entity->collision[entity->n_collisions++] = collision;
+				}
+
+				if (normal.y == -1.0f) {
+					entity->on_ground = true;
+				}
+			}
+		}
+	}
+}
+
+/* damp is a per-second factor; keep the per-frame pow() out of
+ * calculate_velocity by caching it whenever damp changes. The factor stays
+ * a double, as pow's result was, so velocities round as they always did. */
+void set_damping(Entity *e, float x, float y)
+{
+	e->damp.x = x;
+	e->damp.y = y;
+	e->damp_factor_x = pow(x, frame_dt);
+	e->damp_factor_y = pow(y, frame_dt);
+}
+
+/* Not batched across entities: a and a jump's v come out of move_entity's
+ * in-order pass, which sees earlier entities' moves this tick. */
+V2 calculate_velocity(Entity *e)
+{
+	V2 a = e->a;
+	V2 v = e->v;
+
+	a = vector_normalize(a);
+	a.x *= e->speed.x;
+	a.y *= e->speed.y;
+	a = vector_scalar_multiply(a, frame_dt);
+
+	v = vector_add(v, a);
+	v.x *= e->damp_factor_x;
+	v.y *= e->damp_factor_y;
+
+	return v;
+}
+
+V2 calculate_position(V2 a, V2 v)
+{
+	a = vector_scalar_multiply(a, 0.5f * square(frame_dt));
+	v = vector_scalar_multiply(v, frame_dt);
+	V2 dt_p = vector_add(v, a);
+
+	return dt_p;
+}
+
+void apply_jump(Entity *e, float force)
+{
+	if (e->on_ground) {
+		e->v.y -= force;
+		e->on_ground = false;
+	}
+}
+
+void apply_gravity(Entity *entity)
+{
+	if (!entity->on_ladder) {
+		entity->a.y = 1.0f;
+	}
+}
+
+Collision *search_collisions(Entity *e, enum EntityType type)
+{
+	for (int i = 0; i < e->n_collisions; ++i) {
+		if (e->collision[i].type == type) {
+			return &e->collision[i];
+		}
+	}
+
+	return NULL;
+}
+
+void transition_to_ladder(Entity *e)
+{
+	Collision *ladder_collision = search_collisions(e, ladder);
+	Collision *platform_collision = search_collisions(e, platform);
+	Minkowski_Box m = ladder_collision->mink;
+
+	if (!e->on_ladder) {
+		if ((e->motion_input.down && ((int)(m.p.y + m.h) < m.h - e->h)) ||
+			(e->motion_input.up && ((int)(m.p.y + m.h) > e->h))) {
+			if (platform_collision && !e->platform_transition) {
+				if (m.p.x + m.w > (m.w * 0.5f) - 4 && m.p.x + m.w < (m.w * 0.5f) + 4) {
+					e->a.y = 0.0f;
+					e->v.x = 0.0f;
+					e->on_ladder = true;
+					e->ladder_transition = true;
+				}
+			}
+		}
+	} else {
+		if (e->ladder_transition) {
+			if (m.p.x + m.w < (m.w * 0.5) - 0.1f) {
+				e->a.x = 1.0f;
+			} else if (m.p.x + m.w > (m.w * 0.5) + 0.1f) {
+				e->a.x = -1.0f;
+			} else {
+				e->ladder_transition = false;
+				e->v.x = 0.0f;
+			}
+		}
+	}
+}
+
+void transition_to_platform(Entity *e)
+{
+	Collision *platform_collision = search_collisions(e, platform);
+	Entity advance_entity = *e;
+	advance_entity.p.y += 5;
+	detect_collisions(&advance_entity);
+	Collision *advance_platform_collision = search_collisions(&advance_entity, platform);
+
+	if (!platform_collision) {
+		if (advance_platform_collision) {
+			if ((e->motion_input.left || e->motion_input.right) && !e->motion_input.up) {
+				e->platform_transition = true;
+				e->v.y = -50.0f;
+			}
+		}
+
+		if (e->platform_transition) {
+			off_ladder(e);
+		}
+	} else {
+		Minkowski_Box mp = platform_collision->mink;
+
+		if (e->motion_input.left || e->motion_input.right) {
+			if (!e->ladder_transition && !e->platform_transition) {
+				int to_platform_top = (int)mp.p.y + mp.h;
+
+				if (to_platform_top < 5) {
+					e->platform_transition = true;
+					e->a = get_accel(e->motion_input);
+				}
+			}
+		}
+
+		if (e->platform_transition) {
+			e->a = get_accel(e->motion_input);
+			e->a.y = -1.0f;
+		}
+	}
+}
+
+void off_ladder(Entity *e)
+{
+	e->on_ladder = false;
+	e->platform_transition = false;
+	set_damping(e, 0.0001f, 0.9f);
+}
+
+void climb_ladder(Entity *e)
+{
+	Collision *ladder_collision = search_collisions(e, ladder);
+
+	if (!ladder_collision) {
+		off_ladder(e);
+	} else {
+		Minkowski_Box m = ladder_collision->mink;
+		transition_to_ladder(e);
+
+		if (e->on_ladder) {
+			if (!e->ladder_transition) {
+				e->a.x = 0.0f;
+			}
+
+			set_damping(e, 0.0001f, 0.0001f);
+
+			int to_ladder_bottom = (int)m.p.y + m.h;
+			int ladder_bottom = m.h - e->h;
+
+			transition_to_platform(e);
+
+			if (to_ladder_bottom > ladder_bottom) {
+				off_ladder(e);
+			}
+		}
+	}
+}
+
+void reset_animation_cycle(Entity *e)
+{
+	e->clock = 0.0f;
+}
+
+void offset_timer(Entity *e, int *offset)
+{
+	float cycle = 0.5f;
+	float v;
+
+	if (e->anim_state == climbing) {
+		v = fabs(e->v.y);
+	} else if (e->anim_state == dead || e->anim_state == winning) {
+		v = 60.0f;
+	} else {
+		v = fabs(e->v.x);
+	}
+
+	if (e->clock < (cycle * 0.5f) / (v * frame_dt)) {
+		*offset = 1;
+	} else if (e->clock > cycle / (v * frame_dt)) {
+		reset_animation_cycle(e);
+	}
+}
+
+enum SpriteId get_animation_frame(Entity *e)
+{
+	int index = 0;
+	int offset = 0;
+
+	switch (e->anim_state) {
+	case none:
+		break;
+
+	case standing:
+		index = 0;
+		reset_animation_cycle(e);
+		break;
+
+	case walking:
+		index = 0;
+		offset_timer(e, &offset);
+		break;
+
+	case jumping:
+	case landing:
+		index = 0;
+		break;
+
+	case climbing:
+		index = 2;
+		offset_timer(e, &offset);
+		break;
+	case dead:
+		index = 6;
+		offset_timer(e, &offset);
+		break;
+	case winning:
+		index = 10;
+		offset_timer(e, &offset);
+		break;
+	}
+
+#if 1 // missing climbing and dead frames for NPCs
+	if ((e->anim_state == climbing || e->anim_state == dead) && (e->type == 1 || e->type == 2)) {
+		offset = 0;
+		index = 0;
+	}
+#endif
+
+	return entity_sprite_list[e->type][index + offset];
+}
+
+void update_animation_cycle(Entity *e)
+{
+	e->clock += frame_dt;
+
+	if (e->clock > 5.0f) {
+		e->clock = 0.0f;
+	}
+}
+
+int read_level_int(unsigned char **p)
+{
+	int n;
+	memcpy(&n, *p, 4);
+	*p += 4;
+	return n;
+}
+
+/* entities.dat holds n_levels and n_values, then for each level its
+ * entity count followed by the entities, LEVEL_VALUES ints each: id,
+ * type, x, y, w, h. n_values has never been used and is skipped, as
+ * load_entities always did. Returns false if the counts don't fit the
+ * file. */
+bool index_levels()
+{
+	unsigned char *p = level_data;
+	unsigned char *end = level_data + level_size;
+	bool ok = level_size >= 8;
+
+	if (ok) {
+		n_levels = read_level_int(&p);
+		read_level_int(&p);
+		ok = n_levels > 0 && n_levels <= MAX_LEVELS;
+	}
+
+	for (int i = 0; ok && i < n_levels; ++i) {
+		level_offsets[i] = p - level_data;
+		int n_entities = end - p >= 4 ? read_level_int(&p) : -1;
+		ok = n_entities >= 0 && n_entities <= MAX_ENTITIES && end - p >= n_entities * LEVEL_VALUES * 4;
+		p += ok ? n_entities * LEVEL_VALUES * 4 : 0;
+	}
+
+	if (!ok)
+		fprintf(stderr, "entities.dat is malformed\n");
+
+	return ok;
+}
+
+/* Builds a level into t without touching the live game state, so that it
+ * can run on the preload thread. */
+void decode_level(int level, Level_Template *t)
+{
+	unsigned char *p = level_data + level_offsets[level];
+	int n_entities = read_level_int(&p);
+
+	assert(n_entities <= MAX_ENTITIES);
+
+	t->n_entities = 0;
+	reset_handles(&t->handles);
+	memset(&t->grid, 0, sizeof(t->grid));
+
+	for (int i = 0 ; i < n_entities; ++i) {
+		int n;
+		Entity e = {};
+		int id, x, y, w, h;
+		enum EntityType type;
+		id = read_level_int(&p);
+		type = read_level_int(&p);
+
+		Sprite *sprite;
+		sprite = get_sprite(entity_sprite_list[type][0]);
+
+		if (sprite) {
+			w = sprite->bitmap[right].w;
+			h = sprite->bitmap[right].h;
+		}
+
+		x = read_level_int(&p);
+		y = read_level_int(&p);
+
+		n = read_level_int(&p);
+		if (n > 0)
+			w = n;
+
+		n = read_level_int(&p);
+		if (n > 0)
+			h = n;
+
+		if (type == player) {
+			e = player_defaults;
+		} else if (type == hotdog || type == egg) {
+			e = npc_defaults;
+		} else if (type == top_bun || type == tomato || type == meat || type == bottom_bun) {
+			e = burger_defaults;
+		} else if (type == plate) {
+			e = plate_defaults;
+		}
+
+		if (type == ladder || type == door) {
+			e.permeable = true;
+		}
+
+		e.id = id;
+		e.type = type;
+		set_position(&e, x, y);
+		set_dimensions(&e, w, h);
+		set_damping(&e, e.damp.x, e.damp.y);
+
+		int index = entity_index(id);
+		int slot = t->n_entities++;
+
+		assert(entity_generation(id) == 0 && t->handles.slot[index] == -1);
+
+		if (index >= t->handles.next_index)
+			t->handles.next_index = index + 1;
+
+		t->handles.slot[index] = slot;
+		t->entities[slot] = e;
+		t->grid.span[slot] = grid_span(&e);
+		grid_set(&t->grid, slot, t->grid.span[slot], true);
+	}
+
+	build_nav(t);
+
+	if (bake_static_layers)
+		bake_static_layer(t);
+}
+
+void nav_link(Level_Template *t, int from, int to, enum NavStep step)
+{
+	t->nav[from].link[step] = to;
+	t->nav[to].link[step ^ 1] = from;
+}
+
+bool nav_has_ladder(Nav_Node *n, int ladder)
+{
+	return ladder != -1 && (n->ladders[0] == ladder || n->ladders[1] == ladder);
+}
+
+/* A node wherever ladders reach a platform, one for all the ladders at
+ * the same spot, linked to the nearest node each way along the platform
+ * and the ladders. */
+void build_nav(Level_Template *t)
+{
+	t->n_nav = 0;
+
+	for (int i = 0; i < t->n_entities; ++i) {
+		Entity *l = &t->entities[i];
+
+		if (l->type != ladder)
+			continue;
+
+		for (int j = 0; j < t->n_entities; ++j) {
+			Entity *pl = &t->entities[j];
+
+			if (pl->type != platform ||
+				fabs(l->p.x - pl->p.x) > pl->w * 0.5f ||
+				fabs(l->p.y - pl->p.y) > (l->h + pl->h) * 0.5f + 2.0f)
+				continue;
+
+			Nav_Node *n = NULL;
+
+			for (int k = 0; k < t->n_nav; ++k) {
+				if (t->nav[k].platform == pl->id && fabs(t->nav[k].p.x - l->p.x) < 1.0f)
+					n = &t->nav[k];
+			}
+
+			if (!n) {
+				assert(t->n_nav < MAX_NAV_NODES);
+				n = &t->nav[t->n_nav++];
+				*n = (Nav_Node){{l->p.x, pl->p.y}, pl->id, {-1, -1}, {-1, -1, -1, -1}};
+			}
+
+			/* A ladder centred above the platform goes up from it. */
+			n->ladders[l->p.y > pl->p.y] = l->id;
+		}
+	}
+
+	for (int i = 0; i < t->n_nav; ++i) {
+		Nav_Node *n = &t->nav[i];
+		int right_node = -1;
+		int down_node = -1;
+
+		for (int j = 0; j < t->n_nav; ++j) {
+			Nav_Node *m = &t->nav[j];
+
+			if (m->platform == n->platform && m->p.x > n->p.x &&
+				(right_node == -1 || m->p.x < t->nav[right_node].p.x))
+				right_node = j;
+
+			if (nav_has_ladder(m, n->ladders[1]) && m->p.y > n->p.y &&
+				(down_node == -1 || m->p.y < t->nav[down_node].p.y))
+				down_node = j;
+		}
+
+		if (right_node != -1)
+			nav_link(t, i, right_node, step_right);
+
+		if (down_node != -1)
+			nav_link(t, i, down_node, step_down);
+	}
+}
+
+void add_collision(
+	Entity* subject_entity,
+	Entity* object_entity,
+	V2 normal,
+	Minkowski_Box mink)
+{
+	Collision collision;
+	collision.id = object_entity->id;
+	collision.type = object_entity->type;
+	collision.normal = normal;
+	collision.mink = mink;
+	int n = subject_entity->n_collisions++;
+	subject_entity->collision[n] = collision;
+}
+
+void reap_entities()
+{
+	int to_reap_ids[MAX_ENTITIES];
+	int n_to_reap = 0;
+
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->dead) {
+			to_reap_ids[n_to_reap++] = e->id;
+		}
+	}
+
+	for (int i = 0; i < n_to_reap; ++i) {
+		Entity *e = get_entity(to_reap_ids[i]);
+		if (e->p.y > 400) {
+			delete_entity(e);
+		}
+	}
+}
+
+void kill_entities()
+{
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type == hotdog || e->type == egg) {
+			for (int i = 0; i < e->n_collisions; ++i) {
+				Collision c = e->collision[i];
+
+				if (c.normal.y == 1.0f &&
+					(c.type == top_bun ||
+					 c.type == tomato ||
+					 c.type == meat ||
+					 c.type == bottom_bun)) {
+					 e->dead = true;
+				}
+			}
+		}
+
+		if (e->type == player) {
+			for (int i = 0; i < e->n_collisions; ++i) {
+				Collision c = e->collision[i];
+
+				if (c.type == hotdog || c.type == egg) {
+					e->dead = true;
+				}
+			}
+		}
+	}
+}
+
+void spawn_npc()
+{
+	Entity *door_list[4];
+	int n_doors = 0;
+	int n_npcs = 0;
+
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type == egg || e->type == hotdog) {
+			++n_npcs;
+		} else if (e->type == door && n_doors < array_size(door_list)) {
+			door_list[n_doors++] = e;
+		}
+	}
+
+	int r = game_rand() % n_doors;
+	Entity *door = door_list[r];
+
+	if (n_npcs < 4) {
+		game->spawn_timer += frame_dt;
+
+		if (game->spawn_timer > 5) {
+			if (n_npcs % 2) {
+				add_entity(hotdog, door->p.x, door->p.y);
+			} else {
+				add_entity(egg, door->p.x, door->p.y);
+			}
+
+			game->spawn_timer = 0.0f;
+		}
+	}
+}
+
+/* From e's platform and ladder contacts; in the air it is nowhere. */
+Nav_Place nav_place(Level_Template *t, Entity *e)
+{
+	Nav_Place place = {-1, -1, -1, -1, -1, 0.0f, 0.0f, false};
+	Collision *platform_collision = search_collisions(e, platform);
+	Collision *ladder_collision = search_collisions(e, ladder);
+
+	if (platform_collision)
+		place.platform = platform_collision->id;
+
+	if (ladder_collision)
+		place.ladder = ladder_collision->id;
+
+	place.vertical = place.platform == -1;
+
+	for (int i = 0; i < t->n_nav; ++i) {
+		Nav_Node *n = &t->nav[i];
+
+		if (n->platform == place.platform && nav_has_ladder(n, place.ladder)) {
+			place.node = i;
+			return place;
+		}
+	}
+
+	if (place.platform == -1 && place.ladder == -1)
+		return place;
+
+	for (int i = 0; i < t->n_nav; ++i) {
+		Nav_Node *n = &t->nav[i];
+		float d = place.vertical ? e->p.y - n->p.y : e->p.x - n->p.x;
+
+		if (place.vertical ? !nav_has_ladder(n, place.ladder) : n->platform != place.platform)
+			continue;
+
+		if (d >= 0.0f && (place.a == -1 || d < place.da)) {
+			place.a = i;
+			place.da = d;
+		} else if (d < 0.0f && (place.b == -1 || -d < place.db)) {
+			place.b = i;
+			place.db = -d;
+		}
+	}
+
+	return place;
+}
+
+enum NavStep step_toward(V2 from, V2 to, bool vertical)
+{
+	if (vertical)
+		return to.y < from.y ? step_up : step_down;
+
+	return to.x < from.x ? step_left : step_right;
+}
+
+/* Nowhere reached and the player nowhere on the graph, until the next
+ * update_flow_field. The field left by another level, or an earlier run
+ * of this one, would point at nodes that mean something else. */
+void reset_flow_field()
+{
+	game->player_place = (Nav_Place){-1, -1, -1, -1, -1, 0.0f, 0.0f, false};
+
+	for (int i = 0; i < MAX_NAV_NODES; ++i) {
+		game->nav_dist[i] = INFINITY;
+		game->nav_step[i] = step_none;
+	}
+}
+
+/* Dijkstra over the nav graph out from wherever the player stands. While
+ * the player is in the air the last field is kept. */
+void update_flow_field(Entity *player)
+{
+	Level_Template *t = current_template();
+	Nav_Place place = nav_place(t, player);
+	bool done[MAX_NAV_NODES] = {};
+
+	if (place.node == -1 && place.a == -1 && place.b == -1)
+		return;
+
+	game->player_place = place;
+
+	for (int i = 0; i < t->n_nav; ++i) {
+		game->nav_dist[i] = INFINITY;
+		game->nav_step[i] = step_none;
+	}
+
+	if (place.node != -1) {
+		Nav_Node *n = &t->nav[place.node];
+		bool vertical = fabs(player->p.y - n->p.y) > fabs(player->p.x - n->p.x);
+
+		game->nav_dist[place.node] = 0.0f;
+		game->nav_step[place.node] = step_toward(n->p, player->p, vertical);
+	}
+
+	if (place.a != -1) {
+		game->nav_dist[place.a] = place.da;
+		game->nav_step[place.a] = place.vertical ? step_down : step_right;
+	}
+
+	if (place.b != -1) {
+		game->nav_dist[place.b] = place.db;
+		game->nav_step[place.b] = place.vertical ? step_up : step_left;
+	}
+
+	for (;;) {
+		int u = -1;
+
+		for (int i = 0; i < t->n_nav; ++i) {
+			if (!done[i] && game->nav_dist[i] < INFINITY &&
+				(u == -1 || game->nav_dist[i] < game->nav_dist[u]))
+				u = i;
+		}
+
+		if (u == -1)
+			break;
+
+		done[u] = true;
+
+		for (int k = 0; k < n_steps; ++k) {
+			int v = t->nav[u].link[k];
+
+			if (v == -1)
+				continue;
+
+			V2 d = vector_subtract(t->nav[v].p, t->nav[u].p);
+			float dist = game->nav_dist[u] + fabs(d.x) + fabs(d.y);
+
+			if (dist < game->nav_dist[v]) {
+				game->nav_dist[v] = dist;
+				game->nav_step[v] = k ^ 1;
+			}
+		}
+	}
+}
+
+/* The flow field's step for an NPC, straight at the player if they share
+ * a platform or ladder, or step_none if the field doesn't reach it. */
+enum NavStep npc_nav_step(Entity *e)
+{
+	Level_Template *t = current_template();
+	Nav_Place place = nav_place(t, e);
+	Nav_Place *target = &game->player_place;
+
+	if (place.node != -1)
+		return game->nav_step[place.node];
+
+	if (!place.vertical && place.platform == target->platform)
+		return step_toward(e->p, get_entity(0)->p, false);
+
+	if (place.vertical && place.ladder != -1 && place.ladder == target->ladder && target->platform == -1)
+		return step_toward(e->p, get_entity(0)->p, true);
+
+	float cost_a = place.a == -1 ? INFINITY : place.da + game->nav_dist[place.a];
+	float cost_b = place.b == -1 ? INFINITY : place.db + game->nav_dist[place.b];
+
+	if (cost_a == INFINITY && cost_b == INFINITY)
+		return step_none;
+
+	if (cost_a <= cost_b)
+		return place.vertical ? step_up : step_left;
+
+	return place.vertical ? step_down : step_right;
+}
+
+/* At a junction or a wall, or stopped. Anywhere else an NPC just keeps
+ * going the way it was. */
+bool at_decision_point(Entity *e)
+{
+	return (search_collisions(e, platform) &&
+			(search_collisions(e, ladder) || search_collisions(e, wall))) ||
+		(e->a.y == 0.0 && e->a.x == 0.0);
+}
+
+int compare_ai_requests(const void *a, const void *b)
+{
+	const Ai_Request *ra = a;
+	const Ai_Request *rb = b;
+
+	if (ra->priority != rb->priority)
+		return rb->priority - ra->priority;
+
+	return ra->slot - rb->slot;
+}
+
+/* Over the budget, marks ai_budget NPCs to decide this tick, longest
+ * waiting first, with those at a decision point or near the player moved
+ * up the queue. Under it there is nothing to do. */
+void schedule_ai(Entity *player)
+{
+	Entity *entities = game->entities.buffer;
+	Ai_Request requests[MAX_ENTITIES];
+	int n = 0;
+
+	game->ai_throttled = false;
+
+	if (!game->ai_budget)
+		return;
+
+	for (Entity *e = entities; e != game->entities.p; ++e) {
+		if (e->type == hotdog || e->type == egg) {
+			requests[n++] = (Ai_Request){e - entities, 0};
+		}
+	}
+
+	if (n <= game->ai_budget)
+		return;
+
+	game->ai_throttled = true;
+
+	for (int i = 0; i < n; ++i) {
+		Entity *e = &entities[requests[i].slot];
+		requests[i].priority = game->ai_age[entity_index(e->id)];
+
+		if (at_decision_point(e))
+			requests[i].priority += AI_DECISION_BOOST;
+
+		if (player && fabs(e->p.x - player->p.x) + fabs(e->p.y - player->p.y) < AI_NEAR_DISTANCE)
+			requests[i].priority += AI_NEAR_BOOST;
+	}
+
+	qsort(requests, n, sizeof(Ai_Request), compare_ai_requests);
+
+	for (int i = 0; i < n; ++i) {
+		int index = entity_index(entities[requests[i].slot].id);
+		game->ai_due[index] = i < game->ai_budget;
+		game->ai_age[index] = game->ai_due[index] ? 0 : game->ai_age[index] + 1;
+	}
+}
+
+void update_entities()
+{
+	game->win = true;
+
+	for (Entity *e = game->entities.buffer; e != (Entity *)game->entities.p; ++e) {
+		e->prev_p = e->p;
+	}
+
+	long long start = profile_begin();
+	profile_open(phase_ai);
+	Entity *player = get_entity(0);
+
+	if (player)
+		update_flow_field(player);
+
+	schedule_ai(player);
+	profile_switch(phase_move);
+
+	for (Entity *e = game->entities.buffer; e != (Entity *)game->entities.p; ++e) {
+		update_animation_cycle(e);
+
+		if (e->type == top_bun || e->type == tomato || e->type == meat || e->type == bottom_bun) {
+			move_burger_component(e);
+			grid_move_entity(e);
+			if (search_collisions(e, platform) || e->n_collisions == 0)
+				game->win = false;
+		}
+
+		if (e->movable) {
+			move_entity(e);
+			grid_move_entity(e);
+		}
+	}
+
+	profile_close(start);
+	start = profile_begin();
+	spawn_npc();
+	kill_entities();
+	reap_entities();
+	profile_end(phase_reap, start);
+}
+
+Entity *add_entity(enum EntityType type, float x, float y)
+{
+	Entity e = {};
+	Sprite *sprite = get_sprite(entity_sprite_list[type][0]);
+
+	if (type == egg || type == hotdog) {
+		e = npc_defaults;
+	}
+
+	e.id = new_entity_id();
+	e.type = type;
+	set_position(&e, x, y);
+	set_dimensions(&e, sprite->bitmap[right].w, sprite->bitmap[right].h);
+	Entity *p = push_entity(&e);
+	return p;
+}
+
+int entity_index(int id)
+{
+	return id & (MAX_ENTITY_IDS - 1);
+}
+
+int entity_generation(int id)
+{
+	return (unsigned int)id >> ENTITY_INDEX_BITS;
+}
+
+void reset_handles(Handle_Table *table)
+{
+	for (int i = 0; i < MAX_ENTITY_IDS; ++i) {
+		table->slot[i] = -1;
+		table->generation[i] = 0;
+	}
+
+	table->n_free = 0;
+	table->next_index = 0;
+}
+
+int new_entity_id()
+{
+	int index;
+
+	if (game->handles.n_free) {
+		index = game->handles.free_indices[--game->handles.n_free];
+	} else {
+		assert(game->handles.next_index < MAX_ENTITY_IDS);
+		index = game->handles.next_index++;
+	}
+
+	return (game->handles.generation[index] << ENTITY_INDEX_BITS) | index;
+}
+
+Entity *push_entity(Entity *e)
+{
+	int index = entity_index(e->id);
+
+	assert(e->id >= 0 && entity_generation(e->id) == game->handles.generation[index]);
+	assert(game->handles.slot[index] == -1);
+
+	if (index >= game->handles.next_index)
+		game->handles.next_index = index + 1;
+
+	game->handles.slot[index] = game->entities.n_elems;
+	Entity *p = (Entity *)push_memory(&game->entities, e);
+	set_damping(p, p->damp.x, p->damp.y);
+	grid_add_entity(p);
+	return p;
+}
+
+void delete_entity(Entity *e)
+{
+	int index = entity_index(e->id);
+	int slot = game->handles.slot[index];
+	Entity *last = (Entity *)game->entities.buffer + (game->entities.n_elems - 1);
+
+	game->handles.slot[entity_index(last->id)] = slot;
+	game->handles.slot[index] = -1;
+	game->handles.generation[index] = (game->handles.generation[index] + 1) & ((1 << (31 - ENTITY_INDEX_BITS)) - 1);
+	game->handles.free_indices[game->handles.n_free++] = index;
+
+	grid_remove_entity(e);
+	delete_memory(&game->entities, e);
+}
+
+Entity *get_entity(int id)
+{
+	if (id < 0)
+		return NULL;
+
+	int index = entity_index(id);
+
+	if (game->handles.slot[index] == -1 || game->handles.generation[index] != entity_generation(id))
+		return NULL;
+
+	return (Entity *)game->entities.buffer + game->handles.slot[index];
+}
+
+Sprite_Instance make_instance(Entity *e)
+{
+	Sprite_Instance instance = {
+		get_animation_frame(e), e->p, e->prev_p, e->w, e->h, e->direction
+	};
+	return instance;
+}
+
+/* Written so that alpha 1 gives exactly p. */
+V2 interpolate_position(Sprite_Instance *s, float alpha)
+{
+	return vector_subtract(s->p, vector_scalar_multiply(vector_subtract(s->p, s->prev_p), 1.0f - alpha));
+}
+
+void draw_instance(Sprite_Instance *s, float alpha)
+{
+	Sprite *sprite = get_sprite(s->sprite);
+
+	if (sprite) {
+		Bitmap bitmap = sprite->bitmap[s->direction];
+		V2 p = interpolate_position(s, alpha);
+
+		for (int h = 0; h < s->h; h += bitmap.h) {
+			for (int w = 0; w < s->w; w += bitmap.w) {
+				push_draw_command(
+					bitmap,
+					(int)roundf(p.x - (s->w * 0.5f)) + w,
+					(int)roundf(p.y - (s->h * 0.5f)) + h,
+					0, 0, 0, 0,
+					-1
+				);
+			}
+		}
+	}
+}
+
+bool is_static(Entity *e)
+{
+	return e->type == platform || e->type == ladder || e->type == plate || e->type == tablecloth;
+}
+
+/* Background plus everything that never moves, drawn once per level. */
+void bake_static_layer(Level_Template *t)
+{
+	Bitmap *layer = &t->static_layer;
+	Rect clip = {0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT};
+
+	if (!layer->data) {
+		layer->w = DISPLAY_WIDTH;
+		layer->h = DISPLAY_HEIGHT;
+		layer->pitch = DISPLAY_WIDTH * 4;
+		layer->nbytes = DISPLAY_WIDTH * DISPLAY_HEIGHT * 4;
+		layer->data = (unsigned char *)malloc(layer->nbytes);
+	}
+
+	clear_bitmap(*layer, 0);
+	clear_memory(&bake_list);
+	draw_target = &bake_list;
+	push_draw_command(sprites[sprite_background].bitmap[right], 0, 0, 0, 0, 0, 0, -1);
+
+	for (int i = 0; i < t->n_entities; ++i) {
+		if (is_static(&t->entities[i])) {
+			Sprite_Instance instance = make_instance(&t->entities[i]);
+			draw_instance(&instance, 1.0f);
+		}
+	}
+
+	draw_commands(bake_list, *layer, clip);
+	clear_memory(&bake_list);
+}
+
+/* The moving entities in the order they are drawn: burger parts, then
+ * NPCs, then the player on top. */
+void snapshot_entities(Render_Snapshot *s)
+{
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type != hotdog && e->type != egg && e->type != player && !is_static(e)) {
+			s->instances[s->n_instances++] = make_instance(e);
+		}
+	}
+
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type == hotdog || e->type == egg) {
+			s->instances[s->n_instances++] = make_instance(e);
+		}
+	}
+
+	Entity *player = get_entity(0);
+
+	if (player) {
+		s->instances[s->n_instances++] = make_instance(player);
+	}
+}
+
+void draw_screen(Render_Snapshot *s, float alpha)
+{
+	frame_base = &levels[s->level_slot].static_layer;
+
+	for (int i = 0; i < s->n_instances; ++i) {
+		draw_instance(&s->instances[i], alpha);
+	}
+}
+
+void move_burger_component(Entity *e)
+{
+	Collision *platform_collision = search_collisions(e, platform);
+
+	if (!platform_collision) {
+		e->movable = true;
+	} else {
+		if (e->dest.y == 0.0f) {
+			enum Phase phase = profile_switch(phase_detect);
+			detect_collisions(e);
+			profile_switch(phase);
+			Collision *player_collision = search_collisions(e, player);
+			Collision *top_bun_collision = search_collisions(e, top_bun);
+			Collision *tomato_collision = search_collisions(e, tomato);
+			Collision *meat_collision = search_collisions(e, meat);
+			Collision *bottom_bun_collision = search_collisions(e, bottom_bun);
+
+			if (player_collision && player_collision->new && player_collision->normal.y == 1.0f) {
+				e->dest.y = e->p.y + 3.0f;
+			} else if ((top_bun_collision && top_bun_collision->normal.y == 1.0f) ||
+					   (tomato_collision && tomato_collision->normal.y == 1.0f) ||
+					   (meat_collision && meat_collision->normal.y == 1.0f) ||
+					   (bottom_bun_collision && bottom_bun_collision->normal.y == 1.0f)) {
+				e->dest.y = e->p.y + 10.0f;
+			}
+		} else {
+			float diff = e->dest.y - e->p.y;
+
+			if (fabs(diff) > 1.0f) {
+				e->a.y = (diff >= 0) ? 1.0f : -1.0f;
+				e->v = calculate_velocity(e);
+				V2 dt_p = calculate_position(e->a, e->v);
+				e->p = vector_add(e->p, dt_p);
+				e->movable = false;
+			} else {
+				e->dest.y = 0.0f;
+				e->v.y = 0.0f;
+			}
+		}
+
+		if (platform_collision->mink.p.y + (float)get_entity(platform_collision->id)->h > -0.5f) {
+			e->a.y = 1.0f;
+			e->v = calculate_velocity(e);
+			V2 dt_p = calculate_position(e->a, e->v);
+			e->p = vector_add(e->p, dt_p);
+		}
+	}
+}
+
+/* Input, acceleration, ladders and jumps, then the move and its
+ * collisions, one entity at a time: later entities see where earlier ones
+ * ended up this tick. In place, since resolve_collision only needs the
+ * position from before the move. */
+void move_entity(Entity *e)
+{
+	enum Phase phase = profile_switch(phase_ai);
+
+	if (!e->dead && e->anim_state != winning) {
+		if (e->type == player) {
+			e->anim_state = standing;
+			e->motion_input = get_player_motion_input();
+		} else if (e->type == egg || e->type == hotdog) {
+			if (!game->ai_throttled || game->ai_due[entity_index(e->id)])
+				e->motion_input = get_npc_motion_input(e);
+			else
+				e->motion_input.jump = 0;
+		}
+	} else {
+		e->motion_input = (MotionInput){0};
+	}
+
+	profile_switch(phase_move);
+
+	if (!(e->type == player && e->dead)) {
+		e->a = get_accel(e->motion_input);
+		apply_gravity(e);
+	}
+
+	if (e->a.x < 0) e->direction = left;
+	else if (e->a.x > 0) e->direction = right;
+
+	if (e->motion_input.down || e->motion_input.up || e->on_ladder) {
+		climb_ladder(e);
+	}
+
+	if (e->motion_input.jump) {
+		apply_jump(e, 200.0f);
+		e->on_ground = false;
+		e->anim_state = jumping;
+	}
+
+	if (e->on_ladder) {
+		e->on_ground = false;
+		e->anim_state = climbing;
+	}
+
+	V2 old_p = e->p;
+	e->v = calculate_velocity(e);
+	V2 dt_p = calculate_position(e->a, e->v);
+
+	if (fabs(dt_p.x) > 0.1f && e->on_ground) {
+		e->anim_state = walking;
+	}
+
+	if (e->dead) {
+		e->anim_state = dead;
+		if (e->type == player) {
+			e->v = (V2){0};
+			e->a = (V2){0};
+		}
+	}
+
+	e->p = vector_add(e->p, dt_p);
+	profile_switch(phase_detect);
+	detect_collisions(e);
+	profile_switch(phase_resolve);
+
+	if (!e->on_ladder && !e->dead) {
+		resolve_collision(old_p, e, &dt_p);
+	}
+
+	profile_switch(phase);
+}
+
+void set_position(Entity *e, float x, float y)
+{
+	e->p.x = x;
+	e->p.y = y;
+	e->prev_p = e->p;
+}
+
+void set_dimensions(Entity *e, int w, int h)
+{
+	if (w > 0)
+		e->w = w;
+
+	if (h > 0)
+		e->h = h;
+}
+
+void reset_npcs()
+{
+	int to_reap_ids[MAX_ENTITIES];
+	int n_to_reap = 0;
+
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type == egg || e->type == hotdog) {
+			to_reap_ids[n_to_reap++] = e->id;
+		}
+	}
+
+	for (int i = 0; i < n_to_reap; ++i) {
+		Entity *e = get_entity(to_reap_ids[i]);
+		delete_entity(e);
+	}
+}
+
+void reset_screen()
+{
+	game->reset_timer += frame_dt;
+
+	if (game->reset_timer > 3) {
+		reset_npcs();
+		game->reset_npcs_state = true;
+		game->playing = false;
+		get_entity(0)->dead = false;
+
+		if (game->reset_timer > 6) {
+			game->reset_timer = 0.0f;
+			game->playing = true;
+			game->reset_npcs_state = false;
+		}
+	}
 }
 
-void blit_display()
+void ready_screen()
 {
-	SDL_UpdateTexture(display.texture, NULL, (void*)display.data, display.w * 4);
-	SDL_RenderCopy(display.renderer, display.texture, NULL, NULL);
-	SDL_RenderPresent(display.renderer);
+	frame_base = NULL;
+	draw_string(0, 0, "READY", 1.0f, 0xffffff, 1);
 }
 
-void get_input()
+void start_screen()
 {
-	SDL_PumpEvents();
-	const unsigned char *state = SDL_GetKeyboardState(NULL);
-	new_input.key_up = state[SDL_SCANCODE_UP];
-	new_input.key_down = state[SDL_SCANCODE_DOWN];
-	new_input.key_left = state[SDL_SCANCODE_LEFT];
-	new_input.key_right = state[SDL_SCANCODE_RIGHT];
-	new_input.key_a = state[SDL_SCANCODE_A];
-	new_input.key_c = state[SDL_SCANCODE_C];
-	new_input.key_d = state[SDL_SCANCODE_D];
-	new_input.key_q = state[SDL_SCANCODE_Q];
-	new_input.key_f = state[SDL_SCANCODE_F];
-	new_input.key_e = state[SDL_SCANCODE_E];
-	new_input.key_g = state[SDL_SCANCODE_G];
-	new_input.key_l = state[SDL_SCANCODE_L];
-	new_input.key_m = state[SDL_SCANCODE_M];
-	new_input.key_r = state[SDL_SCANCODE_R];
-	new_input.key_s = state[SDL_SCANCODE_S];
-	new_input.key_ctrl = state[SDL_SCANCODE_LCTRL];
-	new_input.key_lshift = state[SDL_SCANCODE_LSHIFT];
-	new_input.key_space = state[SDL_SCANCODE_SPACE];
-	new_input.key_tab = state[SDL_SCANCODE_TAB];
-	new_input.key_return = state[SDL_SCANCODE_RETURN];
+	frame_base = NULL;
+	draw_string(0, 0, "BURGER GIRL", 1.0f, 0xffffff, 1);
+	draw_string(0, 15, "<ENTER> TO PLAY", 1.0f, 0xffffff, 1);
 }
 
-V2 get_accel(MotionInput motion_input)
+Level_Template *current_template()
 {
-	V2 a = {0.0f, 0.0f};
-
-	if (motion_input.up)
-		a.y = -1.0f;
-
-	if (motion_input.down)
-		a.y = 1.0f;
-
-	if (motion_input.right)
-		a.x = 1.0f;
-
-	if (motion_input.left)
-		a.x = -1.0f;
-
-	return a;
+	return env_levels ? &env_levels[game->level] : &levels[current_slot];
 }
 
-MotionInput get_player_motion_input()
+void restore_level()
 {
-	MotionInput motion_input = {};
-
-	if (new_input.key_up)
-		motion_input.up = 1;
+	Level_Template *t = current_template();
+
+	memcpy(game->entities.buffer, t->entities, t->n_entities * sizeof(Entity));
+	game->entities.n_elems = t->n_entities;
+	game->entities.p = (Entity *)game->entities.buffer + game->entities.n_elems;
+	game->handles = t->handles;
+	game->grid = t->grid;
+	reset_flow_field();
+	memset(game->ai_age, 0, sizeof(game->ai_age));
+}
 
-	if (new_input.key_down)
-		motion_input.down = 1;
+void *preload_thread_proc(void *arg)
+{
+	(void)arg;
+	decode_level(preload_level, &levels[!current_slot]);
+	return NULL;
+}
 
-	if (new_input.key_left)
-		motion_input.left = 1;
+void start_preload()
+{
+	if (n_levels < 2)
+		return;
 
-	if (new_input.key_right)
-		motion_input.right = 1;
+	preload_level = (game->level + 1) % n_levels;
 
-	if (new_input.key_ctrl && !old_input.key_ctrl)
-		motion_input.jump = 1;
+	if (pthread_create(&preload_thread, NULL, preload_thread_proc, NULL) != 0) {
+		decode_level(preload_level, &levels[!current_slot]);
+	} else {
+		preloading = true;
+	}
+}
 
-	return motion_input;
+void finish_preload()
+{
+	if (preloading) {
+		pthread_join(preload_thread, NULL);
+		preloading = false;
+	}
 }
 
-MotionInput get_npc_motion_input(Entity *entity)
+void load_levels()
 {
-	MotionInput motion_input = {};
-	float target_x, target_y;
-	Entity *player = get_entity(0);
+	current_slot = 0;
+	game->level = 0;
+	decode_level(game->level, &levels[current_slot]);
+	restore_level();
+	preload_wanted = true;
+}
 
-	if (player) {
-		target_x = player->p.x;
-		target_y = player->p.y;
-	} else {
-		target_x = rand() % DISPLAY_WIDTH;
-		target_y = rand() % DISPLAY_HEIGHT;
+/* The next level was decoded while this one was played; switching to it
+ * only waits if the preload has somehow not finished yet. Without a
+ * render thread to release the slot, as in headless runs, it is decoded
+ * here. */
+void advance_level()
+{
+	if (env_levels) {
+		game->level = (game->level + 1) % n_levels;
+		return;
 	}
 
-	Collision *burger_collision;
-	enum EntityType burger_search[4] = {top_bun, tomato, meat, bottom_bun};
-
-	for (int i = 0; i < 4; ++i) {
-		burger_collision = search_collisions(entity, burger_search[i]);
+	if (n_levels < 2)
+		return;
 
-		if (burger_collision && burger_collision->normal.x != 0.0f) {
-			motion_input.jump = 1;
-			break;
-		}
+	if (preload_wanted) {
+		preload_wanted = false;
+		start_preload();
 	}
 
-	if ((search_collisions(entity, platform) &&
-		 (search_collisions(entity, ladder) ||
-		  search_collisions(entity, wall))) ||
-		(entity->a.y == 0.0 && entity->a.x == 0.0)) {
-		float x_diff = entity->p.x - target_x;
-		float y_diff = entity->p.y - target_y;
+	finish_preload();
+	current_slot = !current_slot;
+	game->level = preload_level;
+	++level_serial;
+	preload_wanted = true;
+}
 
-		if (y_diff < 50) {
-			motion_input.down = 1;
-		} else if (y_diff > 50) {
-			motion_input.up = 1;
-		}
+void reset_game()
+{
+	game->playing = false;
+	game->win = false;
+	game->start_screen_state = true;
+	game->reset_npcs_state = false;
+	restore_level();
+}
 
-		if (x_diff < 0) {
-			motion_input.right = 1;
-		} else if (x_diff > 0) {
-			motion_input.left = 1;
-		}
-	} else {
-		motion_input.left = entity->motion_input.left;
-		motion_input.right = entity->motion_input.right;
-		motion_input.up = entity->motion_input.up;
-		motion_input.down = entity->motion_input.down;
+void win_screen()
+{
+	game->win_timer += frame_dt;
+
+	if (game->win_timer > 5) {
+		advance_level();
+		reset_game();
+		game->win_timer = 0.0f;
 	}
 
-	return motion_input;
 }
 
-void process_ui_input()
+void simulate_frame()
 {
-	if (new_input.key_q) {
-		running = 0;
+	if (preload_wanted && atomic_load(&drawn_level_serial) == level_serial) {
+		preload_wanted = false;
+		start_preload();
 	}
 
-	if (new_input.key_f && !old_input.key_f) {
-		clear_bitmap(display_bitmap, 0);
-		blit_display();
-		unsigned int fs = SDL_GetWindowFlags(display.window) & SDL_WINDOW_FULLSCREEN_DESKTOP;
-		SDL_SetWindowFullscreen(display.window, fs ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
+	if (get_entity(0)->dead || game->reset_npcs_state) {
+		reset_screen();
 	}
-}
 
-void vector_set(V2 *v, float x, float y)
-{
-	v->x = x;
-	v->y = y;
-}
+	if (game->start_screen_state && game->input.key_return) {
+		game->start_screen_state = false;
+		game->playing = true;
+	}
 
-float vector_dot_product(V2 v1, V2 v2)
-{
-	float s = (v1.x * v2.x) + (v1.y * v2.y);
+	if (game->playing) {
+		update_entities();
+	}
 
-	return s;
+	if (game->win) {
+		Entity *player = get_entity(0);
+		player->anim_state = winning;
+		reset_npcs();
+		win_screen();
+	}
 }
 
-V2 vector_add(V2 v1, V2 v2)
+/* Average milliseconds per phase, top left. */
+void draw_profile()
 {
-	v1.x += v2.x;
-	v1.y += v2.y;
+	char line[32];
 
-	return v1;
-}
+	for (int i = 0; i < n_phases; ++i) {
+		snprintf(line, sizeof(line), "%-9s %6.3f", phase_names[i], atomic_load(&phase_avg[i]) / 1e6);
 
-V2 vector_subtract(V2 v1, V2 v2)
-{
-	v1.x -= v2.x;
-	v1.y -= v2.y;
+		for (char *c = line; *c; ++c) {
+			if (*c >= 'a' && *c <= 'z')
+				*c -= 'a' - 'A';
+		}
 
-	return v1;
+		draw_string(2, 2 + (i * 10), line, 1.0f, 0xffff00, 0);
+	}
 }
 
-V2 vector_scalar_multiply(V2 v, float s)
+void publish_snapshot(long long tick_time)
 {
-	v.x *= s;
-	v.y *= s;
+	Render_Snapshot *s = &snapshots[snapshot_back];
+
+	s->n_instances = 0;
+	s->level_slot = current_slot;
+	s->level_serial = level_serial;
+	s->tick_time = tick_time;
+	s->start_screen_state = game->start_screen_state;
+	s->reset_npcs_state = game->reset_npcs_state;
+	s->playing = game->playing;
+	s->win = game->win;
+
+	if (!game->start_screen_state && !(game->reset_npcs_state && !game->playing) && game->playing) {
+		snapshot_entities(s);
+	}
 
-	return v;
+	snapshot_back = atomic_exchange(&snapshot_shared, snapshot_back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
 }
 
-V2 vector_scalar_divide(V2 v, float s)
+/* The newest published snapshot, or the last one again if nothing new
+ * has come in. */
+Render_Snapshot *acquire_snapshot()
 {
-	v.x /= s;
-	v.y /= s;
+	if (atomic_load(&snapshot_shared) & SNAPSHOT_FRESH) {
+		snapshot_front = atomic_exchange(&snapshot_shared, snapshot_front) & ~SNAPSHOT_FRESH;
+	}
 
-	return v;
+	return &snapshots[snapshot_front];
 }
 
-V2 vector_normalize(V2 v)
+void draw_frame(Render_Snapshot *s, float alpha)
 {
-	float lsq = vector_dot_product(v, v);
+	current_draw_list = !current_draw_list;
+	clear_memory(&draw_lists[current_draw_list]);
+	draw_target = &draw_lists[current_draw_list];
+	frame_base = NULL;
+
+	/* The previous frame is composed by now, so the slot it drew from can
+	 * be handed to the preload. */
+	if (s->level_serial != atomic_load(&drawn_level_serial)) {
+		atomic_store(&drawn_level_serial, s->level_serial);
+		full_redraw = true;
+	}
 
-	if (lsq > 1.0f) {
-		float l = sqrt(lsq);
-		v = vector_scalar_divide(v, l);
+	if (s->start_screen_state) {
+		start_screen();
+	} else if (s->reset_npcs_state && !s->playing) {
+		ready_screen();
+	} else if (s->playing) {
+		draw_screen(s, alpha);
 	}
 
-	return v;
+	if (s->win) {
+		draw_string(0, 0, "YOU WIN!", 1.0f, 0xffffff, 1);
+	}
+
+	if (show_profile) {
+		draw_profile();
+	}
 }
 
-float square(float x)
+bool same_command(Draw_Command *a, Draw_Command *b)
 {
-	return x * x;
+	return a->bitmap.data == b->bitmap.data &&
+		a->x == b->x && a->y == b->y &&
+		a->sx_off == b->sx_off && a->sy_off == b->sy_off &&
+		a->sw_off == b->sw_off && a->sh_off == b->sh_off &&
+		a->color == b->color;
 }
 
-V2 find_normal(Minkowski_Box mink)
+/* Overlapping rects are merged so no pixel is redrawn, and so blended,
+ * twice in one frame. */
+void add_dirty_rect(Rect r)
 {
-	V2 normal = {};
-	float sides[4][3] = {
-		{fabs(mink.p.y + mink.h), 0.0f, -1.0f},
-		{fabs(mink.p.x + mink.w), -1.0f, 0.0f},
-		{fabs(mink.p.x), 1.0f, 0.0f},
-		{fabs(mink.p.y), 0.0f, 1.0f}
-	};
-	float min = 5.0f;
+	int i = 0;
 
-	for (int i = 0; i < 4; ++i) {
-		if (sides[i][0] < min) {
-			min = sides[i][0];
-			normal.x = sides[i][1];
-			normal.y = sides[i][2];
+	while (i < n_dirty_rects) {
+		Rect overlap = intersect_rects(r, dirty_rects[i]);
+
+		if (overlap.w && overlap.h) {
+			r = union_rects(r, dirty_rects[i]);
+			dirty_rects[i] = dirty_rects[--n_dirty_rects];
+			i = 0;
+		} else {
+			++i;
 		}
 	}
 
-	return normal;
+	if (n_dirty_rects == MAX_DIRTY_RECTS) {
+		for (i = 0; i < n_dirty_rects; ++i) {
+			r = union_rects(r, dirty_rects[i]);
+		}
+
+		n_dirty_rects = 0;
+	}
+
+	dirty_rects[n_dirty_rects++] = r;
 }
 
-void resolve_collision(Entity* oe, Entity* e1, V2* dt)
+/* Restores and redraws rect, clipped to the given rows. Every pixel is
+ * restored before anything blends into it, which lock_display relies on. */
+void rasterize_rows(Memory list, Rect rect, int y1, int y2)
 {
-	for (int i = 0; i < e1->n_collisions; ++i) {
-		if (!get_entity(e1->collision[i].id)->permeable) {
-			V2 normal = e1->collision[i].normal;
+	Rect rows = {0, y1, DISPLAY_WIDTH, y2 - y1};
+	Rect r = intersect_rects(rect, rows);
 
-			if (normal.y != 0.0f) {
-				e1->p.y = oe->p.y;
-			} else if (normal.x != 0.0f) {
-				e1->p.x = oe->p.x;
-			} else {
-				e1->p = oe->p;
-			}
-		}
+	if (r.w == 0 || r.h == 0)
+		return;
+
+	for (int y = r.y; y < r.y + r.h; ++y) {
+		unsigned char *dest = display_bitmap.data + (y * display_bitmap.pitch) + (r.x * 4);
+
+		if (frame_base)
+			memcpy(dest, frame_base->data + (y * frame_base->pitch) + (r.x * 4), r.w * 4);
+		else
+			memset(dest, 0, r.w * 4);
 	}
 
-	for (int i = 0; i < e1->n_collisions; ++i) {
-		if (!get_entity(e1->collision[i].id)->permeable) {
-			Entity *e2 = get_entity(e1->collision[i].id);
-			V2 normal = e1->collision[i].normal;
-			float t = 1.0f;
+	draw_commands(list, display_bitmap, r);
+}
 
-			float x1 = e1->p.x, y1 = e1->p.y;
-			float x2 = e2->p.x, y2 = e2->p.y;
-			int w1 = e1->hitbox.x > 0 ? e1->hitbox.x : e1->w;
-			int w2 = e2->hitbox.x > 0 ? e2->hitbox.x : e2->w;
-			int h1 = e1->hitbox.y > 0 ? e1->hitbox.y : e1->h;
-			int h2 = e2->hitbox.y > 0 ? e2->hitbox.y : e2->h;
+void rasterize_band(Memory list, Rect rect, int band)
+{
+	rasterize_rows(list, rect,
+		band * DISPLAY_HEIGHT / raster.n_bands,
+		(band + 1) * DISPLAY_HEIGHT / raster.n_bands);
+}
 
+void *raster_thread_proc(void *arg)
+{
+	int band = (int)(intptr_t)arg;
+	int generation = 0;
 
-			if (normal.x == 1.0f && dt->x != 0.0f) {
-				t = ((x1 - (w1 * 0.5f)) - (x2 + (w2 * 0.5f))) / fabs(dt->x);
-			} else if (normal.x == -1.0f && dt->x != 0.0f) {
-				t = ((x2 - (w2 * 0.5f)) - (x1 + (w1 * 0.5f))) / fabs(dt->x);
-			} else if (normal.y == 1.0f && dt->y != 0.0f) {
-				t = ((y1 - (h1 * 0.5f)) - (y2 + (h2 * 0.5f))) / fabs(dt->y);
-			} else if (normal.y == -1.0f && dt->y != 0.0f) {
-				t = ((y2 - (h2 * 0.5f)) - (y1 + (h1 * 0.5f))) / fabs(dt->y);
-			}
+	for (;;) {
+		pthread_mutex_lock(&raster.lock);
 
-			int normal_seen = 0;
+		while (raster.generation == generation)
+			pthread_cond_wait(&raster.start, &raster.lock);
 
-			for (int j = 0; j < i; ++j) {
-				V2 earlier_normal = e1->collision[j].normal;
+		generation = raster.generation;
+		pthread_mutex_unlock(&raster.lock);
 
-				if (earlier_normal.x == normal.x && earlier_normal.y == normal.y) {
-					normal_seen = 1;
-				}
-			}
+		if (band < raster.n_bands) {
+			rasterize_band(raster.list, raster.rect, band);
 
-			if (!normal_seen) {
-				e1->p = vector_add(e1->p, vector_scalar_multiply(*dt, t));
-				e1->v = vector_subtract(e1->v, vector_scalar_multiply(normal, vector_dot_product(e1->v, normal)));
-				*dt = vector_subtract(*dt, vector_scalar_multiply(normal, vector_dot_product(*dt, normal)));
-			}
+			pthread_mutex_lock(&raster.lock);
+			if (--raster.n_pending == 0)
+				pthread_cond_signal(&raster.done);
+			pthread_mutex_unlock(&raster.lock);
 		}
 	}
+
+	return NULL;
 }
 
-Minkowski_Box calculate_minkowski_sum(Entity e1, Entity e2)
+/* One band per online core, up to MAX_RASTER_THREADS. */
+void init_raster_threads()
 {
-	Minkowski_Box mink = {};
-	Minkowski_Box box1 = {e1.p, e1.hitbox.x > 0 ? e1.hitbox.x : e1.w, e1.hitbox.y > 0 ? e1.hitbox.y : e1.h};
-	Minkowski_Box box2 = {e2.p, e2.hitbox.x > 0 ? e2.hitbox.x : e2.w, e2.hitbox.y > 0 ? e2.hitbox.y : e2.h};
-	mink.p.x = (box1.p.x - (box1.w * 0.5f)) - (box2.p.x + (box2.w * 0.5f));
-	mink.p.y = (box1.p.y - (box1.h * 0.5f)) - (box2.p.y + (box2.h * 0.5f));
-	mink.w = box1.w + box2.w;
-	mink.h = box1.h + box2.h;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
 
-	return mink;
-}
+	n = n < 1 ? 1 : (n > MAX_RASTER_THREADS ? MAX_RASTER_THREADS : n);
 
-int is_collision(Minkowski_Box mink)
-{
-	return (
-		mink.p.x <= 0 && mink.p.x + mink.w >= 0 &&
-		mink.p.y <= 0 && mink.p.y + mink.h >= 0
-	);
+	for (int i = 1; i < n; ++i) {
+		if (pthread_create(&raster.threads[raster.n_threads], NULL,
+						   raster_thread_proc, (void *)(intptr_t)i) != 0)
+			break;
+
+		++raster.n_threads;
+	}
+
+	raster.n_bands = raster.n_threads + 1;
 }
 
-void detect_collisions(Entity *entity)
+/* Small rects aren't worth waking the pool for. */
+void rasterize(Memory list, Rect rect)
 {
-	int old_n_collisions = entity->n_collisions;
-	int old_collision_ids[old_n_collisions];
-
-	for (int i = 0; i < old_n_collisions; ++i) {
-		old_collision_ids[i] = entity->collision[i].id;
+	if (raster.n_bands < 2 || rect.w * rect.h < RASTER_MIN_PIXELS) {
+		rasterize_rows(list, rect, 0, DISPLAY_HEIGHT);
+		return;
 	}
 
-	V2 normal = {};
-	entity->n_collisions = 0;
+	pthread_mutex_lock(&raster.lock);
+	raster.list = list;
+	raster.rect = rect;
+	raster.n_pending = raster.n_bands - 1;
+	++raster.generation;
+	pthread_cond_broadcast(&raster.start);
+	pthread_mutex_unlock(&raster.lock);
 
-	for (Entity *other_entity = entities.buffer; other_entity != entities.p; ++other_entity) {
-		if (entity->id != other_entity->id) {
-			Minkowski_Box mink = calculate_minkowski_sum(*entity, *other_entity);
+	rasterize_band(list, rect, 0);
 
-			if (is_collision(mink)) {
-				normal = find_normal(mink);
+	pthread_mutex_lock(&raster.lock);
+	while (raster.n_pending > 0)
+		pthread_cond_wait(&raster.done, &raster.lock);
+	pthread_mutex_unlock(&raster.lock);
+}
 
-				Collision collision;
-				collision.id = other_entity->id;
-				collision.type = other_entity->type;
-				collision.normal = normal;
-				collision.mink = mink;
-				collision.new = true;
+/* Diffs this frame's commands against last frame's, index by index.
+ * A pixel outside every changed command's rect is covered by the same
+ * commands in the same order as before, so only the changed rects are
+ * restored from the base and redrawn. */
+void compose_frame()
+{
+	Memory current = draw_lists[current_draw_list];
+	Memory last = draw_lists[!current_draw_list];
+	Draw_Command *new_commands = get_memory_block(current);
+	Draw_Command *old_commands = get_memory_block(last);
+	Rect screen = {0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT};
 
-				for (int i = 0; i < old_n_collisions; ++i) {
-					if (collision.id == old_collision_ids[i]) {
-						collision.new = false;
-					}
-				}
+	n_dirty_rects = 0;
 
-				int n = entity->n_collisions++;
-				entity->collision[n] = collision;
+	if (full_redraw || frame_base != last_frame_base) {
+		add_dirty_rect(screen);
+	} else {
+		int n = current.n_elems > last.n_elems ? current.n_elems : last.n_elems;
 
-				if (normal.y == -1.0f) {
-					entity->on_ground = true;
-				}
-			}
+		for (int i = 0; i < n; ++i) {
+			if (i < current.n_elems && i < last.n_elems && same_command(&new_commands[i], &old_commands[i]))
+				continue;
+
+			if (i < current.n_elems)
+				add_dirty_rect(new_commands[i].rect);
+
+			if (i < last.n_elems)
+				add_dirty_rect(old_commands[i].rect);
 		}
 	}
-}
 
-V2 calculate_velocity(Entity *e)
-{
-	V2 a = e->a;
-	V2 v = e->v;
+	bool locked = true;
 
-	a = vector_normalize(a);
-	a.x *= e->speed.x;
-	a.y *= e->speed.y;
-	a = vector_scalar_multiply(a, frame_dt);
+	for (int i = 0; i < n_dirty_rects; ++i) {
+		if (!lock_display(dirty_rects[i])) {
+			locked = false;
+			continue;
+		}
 
-	v = vector_add(v, a);
-	v.x *= pow(e->damp.x, frame_dt);
-	v.y *= pow(e->damp.y, frame_dt);
+		rasterize(current, dirty_rects[i]);
+		unlock_display();
+	}
 
-	return v;
+	last_frame_base = frame_base;
+	/* A rect that couldn't be locked is redrawn in full next frame. */
+	full_redraw = !locked;
 }
 
-V2 calculate_position(V2 a, V2 v)
+long long now_ns()
 {
-	a = vector_scalar_multiply(a, 0.5f * square(frame_dt));
-	v = vector_scalar_multiply(v, frame_dt);
-	V2 dt_p = vector_add(v, a);
-
-	return dt_p;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
-void apply_jump(Entity *e, float force)
+/* Sleeps until SPIN_NS before the deadline, then spins the rest, since
+ * the scheduler may wake us a good deal later than asked. */
+void sleep_until(long long deadline)
 {
-	if (e->on_ground) {
-		e->v.y -= force;
-		e->on_ground = false;
+	long long wake = deadline - SPIN_NS;
+
+	if (wake > now_ns()) {
+		struct timespec t = {wake / 1000000000, wake % 1000000000};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+			;
 	}
+
+	while (now_ns() < deadline)
+		;
 }
 
-void apply_gravity(Entity *entity)
+#ifndef BURGER_LIB
+long long refresh_ns()
 {
-	if (!entity->on_ladder) {
-		entity->a.y = 1.0f;
-	}
+	SDL_DisplayMode mode;
+
+	if (SDL_GetCurrentDisplayMode(0, &mode) != 0 || mode.refresh_rate <= 0)
+		return tick_ns;
+
+	return 1000000000LL / mode.refresh_rate;
 }
 
-Collision *search_collisions(Entity *e, enum EntityType type)
+/* Fixed ticks at frame_dt on the monotonic clock. A slow frame is made up
+ * for by at most MAX_CATCH_UP_STEPS ticks, after which the backlog is
+ * dropped. Only the last tick of a batch is published. */
+void *sim_thread_proc(void *arg)
 {
-	for (int i = 0; i < e->n_collisions; ++i) {
-		if (e->collision[i].type == type) {
-			return &e->collision[i];
+	long long next_tick = now_ns();
+
+	(void)arg;
+	profile_ring = &profile_rings[0];
+
+	while (running) {
+		if (sim_paused) {
+			sleep_until(now_ns() + HIDDEN_POLL_NS);
+			next_tick = now_ns();
+			continue;
+		}
+
+		long long now = now_ns();
+		int steps = 0;
+
+		while (now >= next_tick && steps < MAX_CATCH_UP_STEPS) {
+			game->last_input = game->input;
+			pthread_mutex_lock(&input_lock);
+			game->input = shared_input;
+			pthread_mutex_unlock(&input_lock);
+
+			simulate_tick();
+			next_tick += tick_ns;
+			++steps;
+		}
+
+		if (steps > 0) {
+			publish_snapshot(next_tick - tick_ns);
+		}
+
+		if (now >= next_tick) {
+			next_tick = now + tick_ns;
 		}
+
+		sleep_until(next_tick);
 	}
 
 	return NULL;
 }
 
-void transition_to_ladder(Entity *e)
+/* The SDL side: input, drawing and presenting, at the display's rate and
+ * on its own thread, so a stalled present never holds up a tick. Each
+ * frame interpolates the newest snapshot by how far the clock is into its
+ * tick. While the window is hidden the simulation is paused, and while
+ * it is unfocused frames are drawn only every UNFOCUSED_RENDER_TICKS
+ * ticks. */
+void main_loop()
 {
-	Collision *ladder_collision = search_collisions(e, ladder);
-	Collision *platform_collision = search_collisions(e, platform);
-	Minkowski_Box m = ladder_collision->mink;
+	long long next_render = now_ns();
+	long long render_ns = refresh_ns();
+	Input input = {};
 
-	if (!e->on_ladder) {
-		if ((e->motion_input.down && ((int)(m.p.y + m.h) < m.h - e->h)) ||
-			(e->motion_input.up && ((int)(m.p.y + m.h) > e->h))) {
-			if (platform_collision && !e->platform_transition) {
-				if (m.p.x + m.w > (m.w * 0.5f) - 4 && m.p.x + m.w < (m.w * 0.5f) + 4) {
-					e->a.y = 0.0f;
-					e->v.x = 0.0f;
-					e->on_ladder = true;
-					e->ladder_transition = true;
-				}
-			}
+	profile_ring = &profile_rings[1];
+
+	if (pthread_create(&sim_thread, NULL, sim_thread_proc, NULL) != 0) {
+		fprintf(stderr, "can't start simulation thread\n");
+		return;
+	}
+
+	while (running) {
+		unsigned int flags = SDL_GetWindowFlags(display.window);
+
+		if (flags & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED)) {
+			sim_paused = true;
+			SDL_PumpEvents();
+			sleep_until(now_ns() + HIDDEN_POLL_NS);
+			next_render = now_ns();
+			full_redraw = true;
+			continue;
 		}
-	} else {
-		if (e->ladder_transition) {
-			if (m.p.x + m.w < (m.w * 0.5) - 0.1f) {
-				e->a.x = 1.0f;
-			} else if (m.p.x + m.w > (m.w * 0.5) + 0.1f) {
-				e->a.x = -1.0f;
+
+		sim_paused = false;
+
+		long long start = profile_begin();
+		Input last_input = input;
+		get_input(&input);
+		process_ui_input(input, last_input);
+		pthread_mutex_lock(&input_lock);
+		shared_input = input;
+		pthread_mutex_unlock(&input_lock);
+		profile_end(phase_input, start);
+
+		long long now = now_ns();
+		bool presented = false;
+
+		if (now >= next_render) {
+			Render_Snapshot *s = acquire_snapshot();
+			float alpha = (float)(now - s->tick_time) / tick_ns;
+			alpha = alpha < 0.0f ? 0.0f : (alpha > 1.0f ? 1.0f : alpha);
+
+			start = profile_begin();
+			draw_frame(s, alpha);
+			profile_end(phase_draw, start);
+			start = profile_begin();
+			compose_frame();
+			profile_end(phase_raster, start);
+			start = profile_begin();
+			presented = blit_display();
+			profile_end(phase_blit, start);
+
+			if (!(flags & SDL_WINDOW_INPUT_FOCUS)) {
+				next_render = now + tick_ns * UNFOCUSED_RENDER_TICKS;
+			} else if (vsync && presented) {
+				next_render = now;
 			} else {
-				e->ladder_transition = false;
-				e->v.x = 0.0f;
+				/* Also when nothing was presented with vsync: nothing
+				 * waited for the display, and looping now would spin. */
+				next_render = now + render_ns;
 			}
 		}
+
+		/* With vsync the present has already waited for the display. */
+		if (!(vsync && presented)) {
+			sleep_until(next_render);
+		}
 	}
+
+	pthread_join(sim_thread, NULL);
 }
+#endif
 
-void transition_to_platform(Entity *e)
+/* Input script for headless runs: one "<frame> <key> <key> ..." line per
+ * change, keys named as in Input without the key_ prefix. The keys stay
+ * held until the next line. */
+void load_input_script(char *filename)
 {
-	Collision *platform_collision = search_collisions(e, platform);
-	Entity advance_entity = *e;
-	advance_entity.p.y += 5;
-	detect_collisions(&advance_entity);
-	Collision *advance_platform_collision = search_collisions(&advance_entity, platform);
+	FILE *fp = fopen(filename, "r");
 
-	if (!platform_collision) {
-		if (advance_platform_collision) {
-			if ((e->motion_input.left || e->motion_input.right) && !e->motion_input.up) {
-				e->platform_transition = true;
-				e->v.y = -50.0f;
-			}
-		}
+	if (!fp) {
+		fprintf(stderr, "can't open input script %s\n", filename);
+		exit(1);
+	}
 
-		if (e->platform_transition) {
-			off_ladder(e);
-		}
-	} else {
-		Minkowski_Box mp = platform_collision->mink;
+	input_script = reserve_memory(MAX_SCRIPT_EVENTS, sizeof(Input_Event));
+	char line[256];
 
-		if (e->motion_input.left || e->motion_input.right) {
-			if (!e->ladder_transition && !e->platform_transition) {
-				int to_platform_top = (int)mp.p.y + mp.h;
+	while (fgets(line, sizeof(line), fp) && input_script.n_elems < MAX_SCRIPT_EVENTS) {
+		Input_Event event = {};
+		char *word = strtok(line, " \t\n");
 
-				if (to_platform_top < 5) {
-					e->platform_transition = true;
-					e->a = get_accel(e->motion_input);
+		if (!word || *word == '#')
+			continue;
+
+		event.frame = atoi(word);
+
+		while ((word = strtok(NULL, " \t\n"))) {
+			for (int i = 0; i < array_size(input_names); ++i) {
+				if (strcmp(word, input_names[i].name) == 0) {
+					*(int *)((char *)&event.input + input_names[i].offset) = 1;
 				}
 			}
 		}
 
-		if (e->platform_transition) {
-			e->a = get_accel(e->motion_input);
-			e->a.y = -1.0f;
-		}
+		push_memory(&input_script, &event);
 	}
-}
 
-void off_ladder(Entity *e)
-{
-	e->on_ladder = false;
-	e->platform_transition = false;
-	e->damp.x = 0.0001f;
-	e->damp.y = 0.9f;
+	fclose(fp);
 }
 
-void climb_ladder(Entity *e)
+void get_scripted_input(int frame)
 {
-	Collision *ladder_collision = search_collisions(e, ladder);
+	static int next_event = 0;
+	Input_Event *events = get_memory_block(input_script);
 
-	if (!ladder_collision) {
-		off_ladder(e);
-	} else {
-		Minkowski_Box m = ladder_collision->mink;
-		transition_to_ladder(e);
+	while (next_event < input_script.n_elems && events[next_event].frame <= frame) {
+		game->input = events[next_event++].input;
+	}
+}
 
-		if (e->on_ladder) {
-			if (!e->ladder_transition) {
-				e->a.x = 0.0f;
-			}
+unsigned int pack_input(Input input)
+{
+	unsigned int bits = 0;
 
-			e->damp.x = 0.0001f;
-			e->damp.y = 0.0001f;
+	for (int i = 0; i < array_size(input_names); ++i) {
+		if (*(int *)((char *)&input + input_names[i].offset))
+			bits |= 1u << i;
+	}
 
-			int to_ladder_bottom = (int)m.p.y + m.h;
-			int ladder_bottom = m.h - e->h;
+	return bits;
+}
 
-			transition_to_platform(e);
+Input unpack_input(unsigned int bits)
+{
+	Input input = {};
 
-			if (to_ladder_bottom > ladder_bottom) {
-				off_ladder(e);
-			}
-		}
+	for (int i = 0; i < array_size(input_names); ++i) {
+		*(int *)((char *)&input + input_names[i].offset) = (bits >> i) & 1;
 	}
-}
 
-void reset_animation_cycle(Entity *e)
-{
-	e->clock = 0.0f;
+	return input;
 }
 
-void offset_timer(Entity *e, int *offset)
+unsigned int fnv1a(unsigned int h, const void *data, int n)
 {
-	float cycle = 0.5f;
-	float v;
+	const unsigned char *p = data;
 
-	if (e->anim_state == climbing) {
-		v = fabs(e->v.y);
-	} else if (e->anim_state == dead || e->anim_state == winning) {
-		v = 60.0f;
-	} else {
-		v = fabs(e->v.x);
+	for (int i = 0; i < n; ++i) {
+		h ^= p[i];
+		h *= 16777619u;
 	}
 
-	if (e->clock < (cycle * 0.5f) / (v * frame_dt)) {
-		*offset = 1;
-	} else if (e->clock > cycle / (v * frame_dt)) {
-		reset_animation_cycle(e);
+	return h;
+}
+
+/* Everything that decides what happens next. */
+unsigned int state_hash()
+{
+	unsigned int h = 2166136261u;
+	bool flags[4] = {game->start_screen_state, game->reset_npcs_state, game->playing, game->win};
+
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		h = fnv1a(h, &e->id, sizeof(e->id));
+		h = fnv1a(h, &e->type, sizeof(e->type));
+		h = fnv1a(h, &e->anim_state, sizeof(e->anim_state));
+		h = fnv1a(h, &e->p, sizeof(e->p));
+		h = fnv1a(h, &e->v, sizeof(e->v));
+		h = fnv1a(h, &e->dead, sizeof(e->dead));
 	}
+
+	h = fnv1a(h, flags, sizeof(flags));
+	h = fnv1a(h, &game->level, sizeof(game->level));
+	h = fnv1a(h, &game->rng_state, sizeof(game->rng_state));
+	return h;
 }
 
-Bitmap *get_animation_frame(Entity *e)
+void start_recording(char *filename)
 {
-	int index = 0;
-	int offset = 0;
+	Replay_Header header = {REPLAY_MAGIC, REPLAY_VERSION, seed, 0};
 
-	switch (e->anim_state) {
-	case none:
-		break;
+	record_file = fopen(filename, "wb");
 
-	case standing:
-		index = 0;
-		reset_animation_cycle(e);
-		break;
+	if (!record_file) {
+		fprintf(stderr, "can't write recording %s\n", filename);
+		return;
+	}
 
-	case walking:
-		index = 0;
-		offset_timer(e, &offset);
-		break;
+	fwrite(&header, sizeof(header), 1, record_file);
+}
 
-	case jumping:
-	case landing:
-		index = 0;
-		break;
+/* The frame count in the header is only known at the end. */
+void finish_recording()
+{
+	if (!record_file)
+		return;
 
-	case climbing:
-		index = 2;
-		offset_timer(e, &offset);
-		break;
-	case dead:
-		index = 6;
-		offset_timer(e, &offset);
-		break;
-	case winning:
-		index = 10;
-		offset_timer(e, &offset);
-		break;
-	}
+	fseek(record_file, offsetof(Replay_Header, n_frames), SEEK_SET);
+	fwrite(&n_recorded_frames, sizeof(n_recorded_frames), 1, record_file);
+	fclose(record_file);
+	record_file = NULL;
+}
 
-#if 1 // missing climbing and dead frames for NPCs
-	if ((e->anim_state == climbing || e->anim_state == dead) && (e->type == 1 || e->type == 2)) {
-		offset = 0;
-		index = 0;
+/* Takes the seed from the recording, so call it before anything draws a
+ * random number. */
+bool load_replay(char *filename)
+{
+	int size;
+	unsigned char *data = read_file(filename, &size);
+	Replay_Header *header = (Replay_Header *)data;
+
+	if (!data || (size_t)size < sizeof(Replay_Header) ||
+		header->magic != REPLAY_MAGIC || header->version != REPLAY_VERSION || header->n_frames < 0 ||
+		(size_t)size < sizeof(Replay_Header) + (size_t)header->n_frames * sizeof(Replay_Frame)) {
+		fprintf(stderr, "%s is not a recording\n", filename);
+		free(data);
+		return false;
 	}
-#endif
 
-	char **bitmap_list = entity_bitmap_list[e->type];
-	Bitmap *bitmap = (Bitmap *)hash_lookup(bitmap_table, bitmap_list[index + offset]);
-
-	return bitmap;
+	seed = header->seed;
+	n_replay_frames = header->n_frames;
+	replay_frames = (Replay_Frame *)(data + sizeof(Replay_Header));
+	return true;
 }
 
-void update_animation_cycle(Entity *e)
+/* One simulation step. A replay replaces game->input with the recorded
+ * input and checks the recorded hash afterwards; a recording stores
+ * both. The replay ends the run when it runs out. */
+void simulate_tick()
 {
-	e->clock += frame_dt;
+	if (replay_frames) {
+		if (game->tick_count >= n_replay_frames) {
+			running = 0;
+			return;
+		}
 
-	if (e->clock > 5.0f) {
-		e->clock = 0.0f;
+		game->input = unpack_input(replay_frames[game->tick_count].input);
+	}
+
+	long long start = profile_begin();
+	simulate_frame();
+	profile_end(phase_tick, start);
+
+	if (record_file) {
+		Replay_Frame frame = {pack_input(game->input), state_hash()};
+		fwrite(&frame, sizeof(frame), 1, record_file);
+		++n_recorded_frames;
 	}
+
+	if (replay_frames && replay_mismatch < 0 && state_hash() != replay_frames[game->tick_count].hash) {
+		replay_mismatch = game->tick_count;
+		fprintf(stderr, "replay diverged at frame %d\n", game->tick_count);
+	}
+
+	++game->tick_count;
 }
 
-void load_entities(enum EntityType et)
+void headless_loop(int n_frames)
 {
-	FILE *fp = fopen("entities.dat", "r");
-	int n_levels;
-	fread(&n_levels, 4, 1, fp);
-	int n_values;
-	fread(&n_values, 4, 1, fp);
-	int n_entities;
-	fread(&n_entities, 4, 1, fp);
+	struct timespec start, end;
+	int first_tick = game->tick_count;
 
-	for (int i = 0 ; i < n_entities; ++i) {
-		int n;
-		Entity e = {};
-		int id, x, y, w, h;
-		enum EntityType type;
-		fread(&id, 4, 1, fp);
-		fread(&type, 4, 1, fp);
-		if (et == all || et == type) {
-			Bitmap *bitmap;
-			bitmap = (Bitmap *)hash_lookup(bitmap_table, entity_bitmap_list[type][0]);
-
-			if (bitmap) {
-				w = bitmap->w;
-				h =bitmap->h;
-			}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-			fread(&n, 4, 1, fp);
-			x = (float)n;
+	if (replay_frames)
+		n_frames = n_replay_frames;
 
-			fread(&n, 4, 1, fp);
-			y = (float)n;
+	for (int frame = 0; frame < n_frames; ++frame) {
+		game->last_input = game->input;
+		get_scripted_input(frame);
 
-			fread(&n, 4, 1, fp);
-			if (n > 0)
-				w = n;
+		/* No one is there to press enter. */
+		if (game->start_screen_state)
+			game->input.key_return = 1;
 
-			fread(&n, 4, 1, fp);
-			if (n > 0)
-				h = n;
+		simulate_tick();
 
-			if (type == player) {
-				e = player_defaults;
-			} else if (type == hotdog || type == egg) {
-				e = npc_defaults;
-			} else if (type == top_bun || type == tomato || type == meat || type == bottom_bun) {
-				e = burger_defaults;
-			} else if (type == plate) {
-				e = plate_defaults;
-			}
+		if (!running)
+			break;
+	}
 
-			if (type == ladder || type == door) {
-				e.permeable = true;
-			}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-			e.id = id;
-			e.type = type;
-			set_position(&e, x, y);
-			set_dimensions(&e, w, h);
-			push_memory(&entities, &e);
-		}
-	}
+	/* A replay that runs out, or a quit, ends the run early. */
+	int n_stepped = game->tick_count - first_tick;
+	float seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / ns_per_s;
+	printf("%d frames in %.3f s (%.0f frames/s)\n", n_stepped, seconds, n_stepped / seconds);
 }
 
-void add_collision(
-	Entity* subject_entity,
-	Entity* object_entity,
-	V2 normal,
-	Minkowski_Box mink)
+/* Full-screen composes of the same frames with 1, 2, ... bands. */
+void bench_raster(int n_frames)
 {
-	Collision collision;
-	collision.id = object_entity->id;
-	collision.type = object_entity->type;
-	collision.normal = normal;
-	collision.mink = mink;
-	int n = subject_entity->n_collisions++;
-	subject_entity->collision[n] = collision;
+	int max_bands = raster.n_bands;
+	double base = 0.0;
+
+	for (int n = 1; n <= max_bands; ++n) {
+		long long total = 0;
+
+		raster.n_bands = n;
+		restore_level();
+		game->start_screen_state = false;
+		game->playing = true;
+
+		for (int frame = 0; frame < n_frames; ++frame) {
+			simulate_frame();
+			publish_snapshot(0);
+			draw_frame(acquire_snapshot(), 1.0f);
+			full_redraw = true;
+
+			long long start = now_ns();
+			compose_frame();
+			total += now_ns() - start;
+		}
+
+		double ms = total / 1e6 / n_frames;
+
+		if (n == 1)
+			base = ms;
+
+		printf("%2d threads: %.3f ms/frame (%.2fx)\n", n, ms, base / ms);
+	}
 }
 
-void reap_entities()
+/* Tops the NPCs up to n, each dropped at a random spot on a random
+ * platform. */
+void add_bench_npcs(int n)
 {
-	int to_reap_ids[MAX_ENTITIES];
-	int n_to_reap = 0;
+	Entity *platforms[MAX_ENTITIES];
+	int n_platforms = 0;
+	int n_npcs = 0;
 
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->dead) {
-			to_reap_ids[n_to_reap++] = e->id;
-		}
+	for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+		if (e->type == platform)
+			platforms[n_platforms++] = e;
+		else if (e->type == hotdog || e->type == egg)
+			++n_npcs;
 	}
 
-	for (int i = 0; i < n_to_reap; ++i) {
-		Entity *e = get_entity(to_reap_ids[i]);
-		if (e->p.y > 400) {
-			delete_memory(&entities, e);
-		}
+	for (; n_npcs < n && game->entities.n_elems < MAX_ENTITIES && n_platforms; ++n_npcs) {
+		Entity *pl = platforms[game_rand() % n_platforms];
+		float x = pl->p.x - (pl->w * 0.5f) + (game_rand() % pl->w);
+
+		add_entity(n_npcs % 2 ? hotdog : egg, x, pl->p.y - (pl->h * 0.5f) - 8.0f);
 	}
 }
 
-void kill_entities()
+/* update_entities alone, on the first level with the player standing
+ * still and kept alive, at growing NPC counts. */
+void bench_update(int n_frames)
 {
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->type == hotdog || e->type == egg) {
-			for (int i = 0; i < e->n_collisions; ++i) {
-				Collision c = e->collision[i];
+	int counts[] = {4, 16, 64, 192};
 
-				if (c.normal.y == 1.0f &&
-					(c.type == top_bun ||
-					 c.type == tomato ||
-					 c.type == meat ||
-					 c.type == bottom_bun)) {
-					 e->dead = true;
-				}
-			}
-		}
+	for (int c = 0; c < array_size(counts); ++c) {
+		long long total = 0;
+		long long n_moved = 0;
 
-		if (e->type == player) {
-			for (int i = 0; i < e->n_collisions; ++i) {
-				Collision c = e->collision[i];
+		seed_rng(1);
+		restore_level();
+		game->start_screen_state = false;
+		game->playing = true;
 
-				if (c.type == hotdog || c.type == egg) {
-					e->dead = true;
-				}
-			}
+		for (int frame = 0; frame < n_frames; ++frame) {
+			Entity *player = get_entity(0);
+
+			add_bench_npcs(counts[c]);
+
+			if (player)
+				player->dead = false;
+
+			for (Entity *e = game->entities.buffer; e != game->entities.p; ++e)
+				n_moved += e->movable;
+
+			long long start = now_ns();
+			update_entities();
+			total += now_ns() - start;
 		}
+
+		printf("%3d NPCs: %.3f ms/tick, %.3f us per moving entity\n",
+			counts[c], total / 1e6 / n_frames, n_moved ? total / 1e3 / n_moved : 0.0);
 	}
 }
 
-void spawn_npc()
+/* Seeded runs on the first level with the player wandering at random
+ * and kept alive, and the NPCs topped up to n_npcs if that is more than
+ * spawn. Counts every time an NPC stands still for two seconds, which is
+ * an NPC the chase has left stuck. */
+void bench_ai(int n_runs, int n_npcs)
 {
-	static float timer = 0.0f;
-	Entity *door_list[4];
-	int n_doors = 0;
-	int n_npcs = 0;
+	const int n_ticks = 20000;
+	const int still_ticks = 2.0f / frame_dt;
+	int still[MAX_ENTITIES];
+	int still_id[MAX_ENTITIES];
+	int n_stuck = 0;
+	long long total = 0;
+
+	for (int run = 0; run < n_runs; ++run) {
+		seed_rng(run + 1);
+		restore_level();
+		game->start_screen_state = false;
+		game->playing = true;
+		memset(still_id, -1, sizeof(still_id));
+
+		for (int tick = 0; tick < n_ticks; ++tick) {
+			Entity *girl = get_entity(0);
+
+			if (tick % 30 == 0) {
+				int key = game_rand() % 5;
+				game->input = (Input){0};
+				game->input.key_left = key == 1;
+				game->input.key_right = key == 2;
+				game->input.key_up = key == 3;
+				game->input.key_down = key == 4;
+			}
 
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->type == egg || e->type == hotdog) {
-			++n_npcs;
-		} else if (e->type == door && n_doors < array_size(door_list)) {
-			door_list[n_doors++] = e;
-		}
-	}
+			if (girl)
+				girl->dead = false;
 
-	int r = rand() % n_doors;
-	Entity *door = door_list[r];
+			add_bench_npcs(n_npcs);
 
-	if (n_npcs < 4) {
-		timer += frame_dt;
+			long long start = now_ns();
+			update_entities();
+			total += now_ns() - start;
 
-		if (timer > 5) {
-			if (n_npcs % 2) {
-				add_entity(hotdog, door->p.x, door->p.y);
-			} else {
-				add_entity(egg, door->p.x, door->p.y);
-			}
+			for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+				int slot = e - (Entity *)game->entities.buffer;
+
+				/* One on the player has caught her, which a real game
+				 * would reset. */
+				if ((e->type != egg && e->type != hotdog) || e->dead || search_collisions(e, player))
+					continue;
+
+				if (still_id[slot] != e->id) {
+					still_id[slot] = e->id;
+					still[slot] = 0;
+				}
 
-			timer = 0.0f;
+				still[slot] = e->p.x == e->prev_p.x && e->p.y == e->prev_p.y ? still[slot] + 1 : 0;
+				n_stuck += still[slot] == still_ticks;
+			}
 		}
 	}
+
+	printf("%d runs of %d ticks, budget %d: %d NPCs stood still for 2 s, %.3f ms/tick\n",
+		n_runs, n_ticks, game->ai_budget, n_stuck, n_runs ? total / 1e6 / n_runs / n_ticks : 0.0);
 }
 
-void update_entities()
+/* Random spans, a mix of transparent, opaque and blended pixels, through
+ * every kernel this CPU has and blend_span_scalar. Returns whether they
+ * all matched it bit for bit. */
+bool check_blend(int n_spans)
 {
-	win = true;
+	struct {
+		const char *name;
+		void (*span)(unsigned int *, const unsigned int *, int, int);
+		bool supported;
+	} kernels[] = {
+#ifdef HAVE_X86_SIMD
+		{"sse2", blend_span_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", blend_span_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	unsigned int src[72], dest[72], expected[72], result[72];
+	bool ok = true;
 
-	for (Entity *e = entities.buffer; e != (Entity *)entities.p; ++e) {
-		update_animation_cycle(e);
+	seed_rng(1);
 
-		if (e->type == top_bun || e->type == tomato || e->type == meat || e->type == bottom_bun) {
-			move_burger_component(e);
-			if (search_collisions(e, platform) || e->n_collisions == 0)
-				win = false;
+	for (int k = 0; k < array_size(kernels); ++k) {
+		int n_mismatches = 0;
+
+		if (!kernels[k].supported) {
+			printf("%-6s not supported\n", kernels[k].name);
+			continue;
 		}
 
-		if (e->movable) {
-			move_entity(e);
+		for (int i = 0; i < n_spans; ++i) {
+			int first = game_rand() % 4;
+			int n = game_rand() % (array_size(src) - first);
+			int color = game_rand() % 2 ? -1 : game_rand() & 0xffffff;
+
+			for (int x = 0; x < array_size(src); ++x) {
+				unsigned int a = game_rand() % 3 == 0 ? 0 : (game_rand() % 2 ? 0xff : game_rand() & 0xff);
+				src[x] = ((unsigned int)game_rand() << 8) | a;
+				dest[x] = (unsigned int)game_rand() << 1;
+			}
+
+			memcpy(expected, dest, sizeof(dest));
+			memcpy(result, dest, sizeof(dest));
+			blend_span_scalar(expected + first, src + first, n, color);
+			kernels[k].span(result + first, src + first, n, color);
+
+			if (memcmp(expected, result, sizeof(result)) != 0)
+				++n_mismatches;
 		}
+
+		printf("%-6s %d of %d spans differ from scalar\n", kernels[k].name, n_mismatches, n_spans);
+		ok = ok && n_mismatches == 0;
 	}
 
-	spawn_npc();
-	kill_entities();
-	reap_entities();
+	return ok;
 }
 
-Entity *add_entity(enum EntityType type, float x, float y)
+/* Everything the environments share: the assets and every level. Runs
+ * once per process, through env_levels_once; env_levels stays NULL if the
+ * assets fail to load, and every env_create fails. Games keep their
+ * entities on the heap, so the game's arena is never allocated. */
+void init_env_levels()
 {
-	Entity e = {};
-	Bitmap *bitmap = (Bitmap *)hash_lookup(bitmap_table, entity_bitmap_list[type][0]);
+	bake_static_layers = false;
 
-	if (type == egg || type == hotdog) {
-		e = npc_defaults;
-	}
+	if (!load_assets())
+		return;
 
-	int id = 0;
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->id > id)
-			id = e->id;
+	Level_Template *t = calloc(n_levels, sizeof(Level_Template));
+
+	for (int i = 0; i < n_levels; ++i) {
+		decode_level(i, &t[i]);
 	}
 
-	e.id = ++id;
-	e.type = type;
-	set_position(&e, x, y);
-	set_dimensions(&e, bitmap->w, bitmap->h);
-	Entity *p = (Entity *)push_memory(&entities, &e);
-	return p;
+	env_levels = t;
 }
 
-Entity *get_entity(int id)
+/* No one is there to press enter, as in headless runs. */
+void step_game(unsigned int action)
 {
-	Entity *p = entities.buffer;
+	game->last_input = game->input;
+	game->input = unpack_input(action);
 
-	while (p != entities.p) {
-		if (p->id == id) {
-			return p;
-		}
+	if (game->start_screen_state)
+		game->input.key_return = 1;
+
+	simulate_frame();
+	++game->tick_count;
+}
+
+int env_part_first(Env *env, int part)
+{
+	return part * env->n_games / env->n_parts;
+}
 
-		++p;
+void step_env_part(Env *env, int part)
+{
+	for (int i = env_part_first(env, part); i < env_part_first(env, part + 1); ++i) {
+		game = &env->games[i];
+		step_game(env->actions[i]);
 	}
 
-	return NULL;
+	game = &main_game;
 }
 
-void draw_entity(Entity *e)
+/* Which pass of render_observation an entity is drawn in, so that class
+ * ids overlap the way the sprites do on screen. */
+int observation_layer(Entity *e)
 {
-	Bitmap *p = get_animation_frame(e);
+	if (is_static(e))
+		return 0;
+	else if (e->type == player)
+		return 3;
+	else if (e->type == hotdog || e->type == egg)
+		return 2;
+
+	return 1;
+}
 
-	if (p) {
-		Bitmap bitmap = *p;
+/* Straight from the entities' boxes, scaled to w x h: no sprites, no
+ * blending and no static layer. */
+void render_observation(Game *g, unsigned char *pixels, int w, int h, int layout)
+{
+	int plane = w * h;
+	float sx = (float)w / DISPLAY_WIDTH;
+	float sy = (float)h / DISPLAY_HEIGHT;
 
-		if (e->direction == left) {
-			bitmap = flip_bitmap(bitmap);
-		}
+	memset(pixels, 0, plane * (layout == ENV_TYPE_PLANES ? ENV_CHANNELS : 1));
 
-		for (int h = 0; h < e->h; h += bitmap.h) {
-			for (int w = 0; w < e->w; w += bitmap.w) {
-				draw_bitmap(
-					bitmap,
-					display_bitmap,
-					(int)roundf(e->p.x - (e->w * 0.5f)) + w,
-					(int)roundf(e->p.y - (e->h * 0.5f)) + h,
-					0, 0, 0, 0,
-					-1
-				);
+	for (int layer = 0; layer < 4; ++layer) {
+		for (Entity *e = g->entities.buffer; e != g->entities.p; ++e) {
+			if (observation_layer(e) != layer)
+				continue;
+
+			int x1 = (int)floorf((e->p.x - (e->w * 0.5f)) * sx);
+			int y1 = (int)floorf((e->p.y - (e->h * 0.5f)) * sy);
+			int x2 = (int)ceilf((e->p.x + (e->w * 0.5f)) * sx);
+			int y2 = (int)ceilf((e->p.y + (e->h * 0.5f)) * sy);
+
+			x1 = x1 < 0 ? 0 : x1;
+			y1 = y1 < 0 ? 0 : y1;
+			x2 = x2 > w ? w : x2;
+			y2 = y2 > h ? h : y2;
+
+			if (x1 >= x2)
+				continue;
+
+			unsigned char *dest = pixels;
+			unsigned char value = e->type + 1;
+
+			if (layout == ENV_TYPE_PLANES) {
+				dest += e->type * plane;
+				value = 255;
+			}
+
+			for (int y = y1; y < y2; ++y) {
+				memset(dest + (y * w) + x1, value, x2 - x1);
 			}
 		}
 	}
 }
 
-void draw_screen()
+void render_env_part(Env *env, int part)
 {
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->type != hotdog && e->type != egg && e->type != player) {
-			draw_entity(e);
-		}
-	}
-
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->type == hotdog || e->type == egg) {
-			draw_entity(e);
-		}
-	}
-
-	Entity *player = get_entity(0);
+	int size = env->obs_w * env->obs_h * (env->obs_layout == ENV_TYPE_PLANES ? ENV_CHANNELS : 1);
 
-	if (player) {
-		draw_entity(player);
+	for (int i = env_part_first(env, part); i < env_part_first(env, part + 1); ++i) {
+		render_observation(&env->games[i], env->pixels + ((size_t)i * size),
+						   env->obs_w, env->obs_h, env->obs_layout);
 	}
 }
 
-void move_burger_component(Entity *e)
+void *env_thread_proc(void *arg)
 {
-	Collision *platform_collision = search_collisions(e, platform);
+	Env_Worker *worker = arg;
+	Env *env = worker->env;
+	int generation = 0;
 
-	if (!platform_collision) {
-		e->movable = true;
-	} else {
-		if (e->dest.y == 0.0f) {
-			detect_collisions(e);
-			Collision *player_collision = search_collisions(e, player);
-			Collision *top_bun_collision = search_collisions(e, top_bun);
-			Collision *tomato_collision = search_collisions(e, tomato);
-			Collision *meat_collision = search_collisions(e, meat);
-			Collision *bottom_bun_collision = search_collisions(e, bottom_bun);
+	for (;;) {
+		pthread_mutex_lock(&env->lock);
 
-			if (player_collision && player_collision->new && player_collision->normal.y == 1.0f) {
-				e->dest.y = e->p.y + 3.0f;
-			} else if ((top_bun_collision && top_bun_collision->normal.y == 1.0f) ||
-					   (tomato_collision && tomato_collision->normal.y == 1.0f) ||
-					   (meat_collision && meat_collision->normal.y == 1.0f) ||
-					   (bottom_bun_collision && bottom_bun_collision->normal.y == 1.0f)) {
-				e->dest.y = e->p.y + 10.0f;
-			}
-		} else {
-			float diff = e->dest.y - e->p.y;
+		while (env->generation == generation && !env->quit)
+			pthread_cond_wait(&env->start, &env->lock);
 
-			if (fabs(diff) > 1.0f) {
-				e->a.y = (diff >= 0) ? 1.0f : -1.0f;
-				e->v = calculate_velocity(e);
-				V2 dt_p = calculate_position(e->a, e->v);
-				e->p = vector_add(e->p, dt_p);
-				e->movable = false;
-			} else {
-				e->dest.y = 0.0f;
-				e->v.y = 0.0f;
-			}
-		}
+		generation = env->generation;
+		bool quit = env->quit;
+		pthread_mutex_unlock(&env->lock);
 
-		if (platform_collision->mink.p.y + (float)get_entity(platform_collision->id)->h > -0.5f) {
-			e->a.y = 1.0f;
-			e->v = calculate_velocity(e);
-			V2 dt_p = calculate_position(e->a, e->v);
-			e->p = vector_add(e->p, dt_p);
-		}
+		if (quit)
+			break;
+
+		env->work(env, worker->part);
+
+		pthread_mutex_lock(&env->lock);
+		if (--env->n_pending == 0)
+			pthread_cond_signal(&env->done);
+		pthread_mutex_unlock(&env->lock);
 	}
+
+	return NULL;
 }
 
-void move_entity(Entity *entity)
+Env *env_create(int n_instances, int n_threads)
 {
-	Entity new_entity = *entity;
-
-	if (!new_entity.dead && new_entity.anim_state != winning) {
-		if (new_entity.type == player) {
-			new_entity.anim_state = standing;
-			new_entity.motion_input = get_player_motion_input();
-		} else if (new_entity.type == egg || new_entity.type == hotdog) {
-			new_entity.motion_input = get_npc_motion_input(&new_entity);
-		}
-	} else {
-		new_entity.motion_input = (MotionInput){0};
-	}
+	pthread_once(&env_levels_once, init_env_levels);
 
-	if (!(new_entity.type == player && new_entity.dead)) {
-		new_entity.a = get_accel(new_entity.motion_input);
-		apply_gravity(&new_entity);
-	}
+	if (!env_levels)
+		return NULL;
 
-	if (new_entity.a.x < 0) new_entity.direction = left;
-	else if (new_entity.a.x > 0) new_entity.direction = right;
+	Env *env = calloc(1, sizeof(Env));
 
-	if (new_entity.motion_input.down || new_entity.motion_input.up || new_entity.on_ladder) {
-		climb_ladder(&new_entity);
-	}
+	env->n_games = n_instances;
+	env->games = calloc(n_instances, sizeof(Game));
 
-	if (new_entity.motion_input.jump) {
-		apply_jump(&new_entity, 200.0f);
-		new_entity.on_ground = false;
-		new_entity.anim_state = jumping;
+	for (int i = 0; i < n_instances; ++i) {
+		env->games[i].entities = heap_memory(MAX_ENTITIES, sizeof(Entity));
 	}
 
-	if (new_entity.on_ladder) {
-		new_entity.on_ground = false;
-		new_entity.anim_state = climbing;
-	}
+	if (n_threads < 1)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	new_entity.v = calculate_velocity(&new_entity);
-	V2 dt_p = calculate_position(new_entity.a, new_entity.v);
+	n_threads = n_threads < 1 ? 1 : (n_threads > MAX_ENV_THREADS ? MAX_ENV_THREADS : n_threads);
+	n_threads = n_threads > n_instances ? n_instances : n_threads;
 
-	if (fabs(dt_p.x) > 0.1f && new_entity.on_ground) {
-		new_entity.anim_state = walking;
-	}
+	pthread_mutex_init(&env->lock, NULL);
+	pthread_cond_init(&env->start, NULL);
+	pthread_cond_init(&env->done, NULL);
 
-	if (new_entity.dead) {
-		new_entity.anim_state = dead;
-		if (new_entity.type == player) {
-			new_entity.v = (V2){0};
-			new_entity.a = (V2){0};
-		}
-	}
+	for (int i = 1; i < n_threads; ++i) {
+		Env_Worker *worker = &env->workers[env->n_threads];
+		*worker = (Env_Worker){env, env->n_threads + 1};
 
-	new_entity.p = vector_add(new_entity.p, dt_p);
-	detect_collisions(&new_entity);
+		if (pthread_create(&env->threads[env->n_threads], NULL, env_thread_proc, worker) != 0)
+			break;
 
-	if (!new_entity.on_ladder && !new_entity.dead) {
-		resolve_collision(entity, &new_entity, &dt_p);
+		++env->n_threads;
 	}
 
-	*entity = new_entity;
+	env->n_parts = env->n_threads + 1;
+	return env;
 }
 
-void set_position(Entity *e, float x, float y)
+void env_destroy(Env *env)
 {
-	e->p.x = x;
-	e->p.y = y;
-}
+	pthread_mutex_lock(&env->lock);
+	env->quit = true;
+	pthread_cond_broadcast(&env->start);
+	pthread_mutex_unlock(&env->lock);
 
-void set_dimensions(Entity *e, int w, int h)
-{
-	if (w > 0)
-		e->w = w;
+	for (int i = 0; i < env->n_threads; ++i) {
+		pthread_join(env->threads[i], NULL);
+	}
 
-	if (h > 0)
-		e->h = h;
+	for (int i = 0; i < env->n_games; ++i) {
+		free(env->games[i].entities.buffer);
+	}
+
+	pthread_mutex_destroy(&env->lock);
+	pthread_cond_destroy(&env->start);
+	pthread_cond_destroy(&env->done);
+	free(env->games);
+	free(env);
 }
 
-void reset_npcs()
+void env_set_ai_budget(Env *env, int budget)
 {
-	int to_reap_ids[MAX_ENTITIES];
-	int n_to_reap = 0;
+	env->ai_budget = budget < 0 ? 0 : budget;
 
-	for (Entity *e = entities.buffer; e != entities.p; ++e) {
-		if (e->type == egg || e->type == hotdog) {
-			to_reap_ids[n_to_reap++] = e->id;
-		}
+	for (int i = 0; i < env->n_games; ++i) {
+		env->games[i].ai_budget = env->ai_budget;
 	}
+}
 
-	for (int i = 0; i < n_to_reap; ++i) {
-		Entity *e = get_entity(to_reap_ids[i]);
-		delete_memory(&entities, e);
+void env_reset(Env *env, const unsigned int *seeds)
+{
+	for (int i = 0; i < env->n_games; ++i) {
+		Game *g = &env->games[i];
+		Memory entities = g->entities;
+
+		memset(g, 0, sizeof(*g));
+		g->entities = entities;
+		g->ai_budget = env->ai_budget;
+		game = g;
+		seed_rng(seeds[i]);
+		reset_game();
+		g->start_screen_state = false;
+		g->playing = true;
 	}
+
+	game = &main_game;
 }
 
-void reset_screen()
+void run_env_parts(Env *env, void (*work)(Env *, int))
 {
-	static float timer = 0.0;
+	if (env->n_parts < 2) {
+		work(env, 0);
+		return;
+	}
 
-	timer += frame_dt;
+	pthread_mutex_lock(&env->lock);
+	env->work = work;
+	env->n_pending = env->n_parts - 1;
+	++env->generation;
+	pthread_cond_broadcast(&env->start);
+	pthread_mutex_unlock(&env->lock);
 
-	if (timer > 3) {
-		reset_npcs();
-		reset_npcs_state = true;
-		playing = false;
-		get_entity(0)->dead = false;
-		clear_bitmap(display_bitmap, 0);
-		draw_string(display_bitmap, 0, 0, "READY", 1.0f, 0xffffff, 1);
+	work(env, 0);
 
-		if (timer > 6) {
-			timer = 0.0f;
-			playing = true;
-			reset_npcs_state = false;
-		}
-	}
+	pthread_mutex_lock(&env->lock);
+	while (env->n_pending > 0)
+		pthread_cond_wait(&env->done, &env->lock);
+	pthread_mutex_unlock(&env->lock);
 }
 
-void start_screen()
+void env_step(Env *env, const unsigned int *actions)
 {
-	clear_bitmap(display_bitmap, 0);
-	draw_string(display_bitmap, 0, 0, "BURGER GIRL", 1.0f, 0xffffff, 1);
-	draw_string(display_bitmap, 0, 15, "<ENTER> TO PLAY", 1.0f, 0xffffff, 1);
+	env->actions = actions;
+	run_env_parts(env, step_env_part);
 }
 
-void reset_game()
+void env_render(Env *env, unsigned char *pixels, int w, int h, int layout)
 {
-	playing = false;
-	win = false;
-	start_screen_state = true;
-	reset_npcs_state = false;
-	entities.p = entities.buffer;
-	entities.n_elems = 0;
-	load_entities(all);
+	env->pixels = pixels;
+	env->obs_w = w;
+	env->obs_h = h;
+	env->obs_layout = layout;
+	run_env_parts(env, render_env_part);
 }
 
-void win_screen()
+void env_observe(Env *env, Env_Observation *observations)
 {
-	static float timer = 0.0;
+	for (int i = 0; i < env->n_games; ++i) {
+		Env_Observation *o = &observations[i];
+		game = &env->games[i];
 
-	timer += frame_dt;
+		Entity *player = get_entity(0);
+		memset(o, 0, sizeof(*o));
 
-	draw_string(display_bitmap, 0, 0, "YOU WIN!", 1.0f, 0xffffff, 1);
+		if (player) {
+			o->player_x = player->p.x;
+			o->player_y = player->p.y;
+			o->dead = player->dead;
+		}
 
-	if (timer > 5) {
-		reset_game();
-		timer = 0.0f;
+		for (Entity *e = game->entities.buffer; e != game->entities.p; ++e) {
+			if (e->type == hotdog || e->type == egg)
+				++o->n_npcs;
+		}
+
+		o->level = game->level;
+		o->tick = game->tick_count;
+		o->playing = game->playing;
+		o->win = game->win;
+		o->hash = state_hash();
 	}
 
+	game = &main_game;
 }
 
-void main_loop()
+#ifndef BURGER_LIB
+/* The count after a bench's flag in argv[1]: fallback if there is none,
+ * or 0, having said so, if it isn't a positive number. */
+int bench_count(int argc, char **argv, int fallback)
 {
-	struct timespec current_time;
-	uint32_t accumulated_time = 0;
-	uint32_t target_time = frame_dt * 1000000000; /* nanoseconds */
+	if (argc < 3 || strncmp(argv[2], "--", 2) == 0)
+		return fallback;
 
-	clock_gettime(CLOCK_REALTIME, &current_time);
+	int n = atoi(argv[2]);
 
-	while (running) {
-		if (accumulated_time > target_time) {
-			old_input = new_input;
-			get_input();
-			process_ui_input();
+	if (n <= 0)
+		fprintf(stderr, "%s takes a positive count, not %s\n", argv[1], argv[2]);
 
-			if (get_entity(0)->dead || reset_npcs_state) {
-				reset_screen();
-			}
+	return n > 0 ? n : 0;
+}
 
-			if (start_screen_state) {
-				start_screen();
-				if (new_input.key_return) {
-					start_screen_state = false;
-					playing = true;
-				}
-			}
+int main(int argc, char **argv)
+{
+	bool headless = false;
+	int n_frames = 3600;
+	char *script = NULL;
+	char *pack = NULL;
+	char *profile = NULL;
+	char *record = NULL;
+	char *replay = NULL;
+	int bench_frames = 0;
+	int check_spans = 0;
+	int bench_update_frames = 0;
+	int bench_ai_runs = 0;
+	int bench_ai_npcs = 0;
+
+	if (argc > 1 && strcmp(argv[1], "--pack") == 0) {
+		headless = true;
+		pack = argc > 2 ? argv[2] : PACK_FILE;
+	}
 
-			if (playing) {
-				update_entities();
-				clear_bitmap(display_bitmap, 0);
-				background_bitmap = *(Bitmap *)hash_lookup(bitmap_table, "background");
-				draw_bitmap(background_bitmap, display_bitmap, 0, 0, 0, 0, 0, 0, -1);
-				draw_screen();
+	display.scale = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--vsync") == 0) {
+			vsync = true;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay = argv[++i];
+		} else if (strcmp(argv[i], "--ai-budget") == 0 && i + 1 < argc) {
+			main_game.ai_budget = atoi(argv[++i]);
+			main_game.ai_budget = main_game.ai_budget < 0 ? 0 : main_game.ai_budget;
+		} else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profile = argv[++i];
+		} else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+			if (strcmp(argv[++i], "epx") == 0) {
+				display.scale = 2;
+				display.epx = true;
+			} else {
+				display.scale = atoi(argv[i]);
+				display.scale = display.scale < 1 ? 1 : (display.scale > MAX_SCALE ? MAX_SCALE : display.scale);
 			}
+		}
+	}
 
-			if (win) {
-				Entity *player = get_entity(0);
-				player->anim_state = winning;
-				reset_npcs();
-				win_screen();
-			}
+	if (argc > 1 && strcmp(argv[1], "--bench-raster") == 0) {
+		headless = true;
+		bench_frames = bench_count(argc, argv, 600);
 
-			blit_display();
+		if (!bench_frames)
+			return 1;
+	}
 
-#if 0
-			printf("%f\n", accumulated_time / 1000000000.0f);
-#endif
-			accumulated_time -= target_time;
-			usleep(4000);
-		}
+	if (argc > 1 && strcmp(argv[1], "--bench-update") == 0) {
+		headless = true;
+		bench_update_frames = bench_count(argc, argv, 600);
+
+		if (!bench_update_frames)
+			return 1;
+	}
 
-		uint32_t last_time = current_time.tv_nsec;
-		clock_gettime(CLOCK_REALTIME, &current_time);
-		int32_t diff_time = current_time.tv_nsec - last_time;
+	if (argc > 1 && strcmp(argv[1], "--bench-ai") == 0) {
+		headless = true;
+		bench_ai_runs = bench_count(argc, argv, 64);
 
-		if (diff_time < 0) {
-			diff_time += 1000000000;
-		}
+		if (!bench_ai_runs)
+			return 1;
 
-		accumulated_time += diff_time;
+		/* npcs only follows a runs count. */
+		if (argc > 3 && strncmp(argv[2], "--", 2) != 0 && strncmp(argv[3], "--", 2) != 0)
+			bench_ai_npcs = atoi(argv[3]) > 0 ? atoi(argv[3]) : 0;
 	}
-}
 
-int main()
-{
-	srand(time(NULL));
-	init_display();
-	init_memory(1024 * 1024);
-	load_win_bmps();
-	chars_bitmap = read_win_bmp("assets/chars/chars.bmp");
-	bitmap_buffer = reserve_memory(1024 * 100, 1);
-	entities = reserve_memory(MAX_ENTITIES, sizeof(Entity));
-	load_entities(all);
+	if (argc > 1 && strcmp(argv[1], "--check-blend") == 0) {
+		check_spans = bench_count(argc, argv, 100000);
+
+		if (!check_spans)
+			return 1;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--headless") == 0) {
+		headless = true;
+
+		if (argc > 2 && strncmp(argv[2], "--", 2) != 0)
+			n_frames = atoi(argv[2]);
+
+		if (argc > 3 && strncmp(argv[3], "--", 2) != 0)
+			script = argv[3];
+	}
+
+	seed = (unsigned int)time(NULL);
+
+	if (replay && !load_replay(replay))
+		return 1;
+
+	seed_rng(seed);
+	profile_epoch = now_ns();
+	init_blend();
+	init_upscale();
+
+	if (check_spans)
+		return check_blend(check_spans) ? 0 : 1;
+
+	if (!headless)
+		init_display();
+
+	bake_static_layers = !headless || bench_frames;
+
+	init_memory(4 * 1024 * 1024);
+
+	if (pack) {
+		init_sprite_table();
+
+		if (!load_win_bmps())
+			return 1;
+
+		write_pack(pack);
+		return 0;
+	}
+
+	if (!load_assets())
+		return 1;
+
+	game->entities = reserve_memory(MAX_ENTITIES, sizeof(Entity));
+	draw_lists[0] = reserve_memory(MAX_DRAW_COMMANDS, sizeof(Draw_Command));
+	draw_lists[1] = reserve_memory(MAX_DRAW_COMMANDS, sizeof(Draw_Command));
+	bake_list = reserve_memory(MAX_DRAW_COMMANDS, sizeof(Draw_Command));
+	load_levels();
 	display_bitmap.w = DISPLAY_WIDTH;
 	display_bitmap.h = DISPLAY_HEIGHT;
-	display_bitmap.data = (unsigned char *)malloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * 4);
-	display.data = display_bitmap.data;
-	main_loop();
+	display_bitmap.pitch = DISPLAY_WIDTH * 4;
+
+	/* At scale 1 in a window lock_display points it at the texture. */
+	if (headless || display_scaled())
+		display_bitmap.data = (unsigned char *)malloc(DISPLAY_WIDTH * DISPLAY_HEIGHT * 4);
+
+	if (record)
+		start_recording(record);
+
+	if (bench_frames) {
+		init_raster_threads();
+		bench_raster(bench_frames);
+	} else if (bench_update_frames) {
+		bench_update(bench_update_frames);
+	} else if (bench_ai_runs) {
+		bench_ai(bench_ai_runs, bench_ai_npcs);
+	} else if (headless) {
+		if (script)
+			load_input_script(script);
+
+		/* Only profiled on request, so the frame rate stays comparable. */
+		if (profile)
+			profile_ring = &profile_rings[0];
+
+		headless_loop(n_frames);
+	} else {
+		init_raster_threads();
+		main_loop();
+	}
+
+	finish_preload();
+	finish_recording();
+
+	if (replay) {
+		if (replay_mismatch < 0)
+			printf("replay matched all %d frames\n", game->tick_count);
+		else
+			printf("replay diverged at frame %d of %d\n", replay_mismatch, game->tick_count);
+	}
+
+	if (profile)
+		write_profile(profile);
+
 	free(memory.buffer);
 
 	return 0;
 }
 
+#endif
@@ -0,0 +1,67 @@
+/* Batched environments: any number of independent runs of the game,
+ * stepped together on a pool of threads, for bots. burger.c built with
+ * -DBURGER_LIB (see build) is the library. Assets are loaded from the
+ * working directory, as the game does. */
+#ifndef BURGER_H
+#define BURGER_H
+
+/* Action bits, one per key, in the order of burger.c's input_names. */
+#define ENV_UP (1u << 0)
+#define ENV_DOWN (1u << 1)
+#define ENV_LEFT (1u << 2)
+#define ENV_RIGHT (1u << 3)
+#define ENV_JUMP (1u << 15)
+
+/* env_render layouts. ENV_CLASS_IDS is one plane holding the type + 1
+ * of the topmost entity at each pixel, or 0. ENV_TYPE_PLANES is
+ * ENV_CHANNELS planes, one per entity type, 255 where it is present. */
+#define ENV_CLASS_IDS 0
+#define ENV_TYPE_PLANES 1
+#define ENV_CHANNELS 13
+
+/* The library is built with -fvisibility=hidden; only these are
+ * exported. */
+#if defined(BURGER_LIB) && defined(__GNUC__)
+#define ENV_API __attribute__((visibility("default")))
+#else
+#define ENV_API
+#endif
+
+typedef struct Env Env;
+
+typedef struct {
+	float player_x, player_y;
+	int n_npcs;
+	int level;
+	int tick;
+	int dead;
+	int playing;
+	int win;
+	unsigned int hash; /* same as --record's per-tick hash */
+} Env_Observation;
+
+/* n_threads 0 means one per online core. The first call loads the
+ * assets and decodes every level; NULL means they are missing or
+ * malformed, and the reason went to stderr. */
+ENV_API Env *env_create(int n_instances, int n_threads);
+ENV_API void env_destroy(Env *env);
+
+/* Restarts every instance at the first level, past the title screen,
+ * with seeds[i] as instance i's random seed. */
+ENV_API void env_reset(Env *env, const unsigned int *seeds);
+
+/* At most budget NPC decisions per tick in each instance, 0 (the
+ * default) for no limit. Kept across env_reset. */
+ENV_API void env_set_ai_budget(Env *env, int budget);
+
+/* One tick of every instance, with actions[i] held by instance i. Call
+ * env_reset before the first. */
+ENV_API void env_step(Env *env, const unsigned int *actions);
+
+ENV_API void env_observe(Env *env, Env_Observation *observations);
+
+/* Every instance's screen at w x h (84 x 84, say) in the given layout,
+ * one instance after another in pixels, which the caller owns. */
+ENV_API void env_render(Env *env, unsigned char *pixels, int w, int h, int layout);
+
+#endif